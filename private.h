@@ -1,6 +1,7 @@
 #include "rM-input-devices.h"
 
 #include <pthread.h>
+#include <stdint.h>
 
 
 struct fd_list {
@@ -8,34 +9,101 @@ struct fd_list {
   struct fd_list *next;
 };
 
-#define N_SLOTS 32
+struct pen_filter_state {
+  int have; /* the fields below hold a previous sample */
+  int64_t t; /* us */
+  int db_x; int db_y; /* last position that escaped the deadband */
+  int64_t v[2]; /* One Euro filtered x/y, Q16 */
+  int64_t dv[2]; /* One Euro filtered x/y velocity, Q16 units/s */
+};
+
+/* Seqlock-published copies of the decoder state, written by the input
+ * thread once per frame. The payloads are made of ints only, and are
+ * copied an int at a time (see seq_publish). */
+struct pen_snapshot {
+  uint seq;
+  struct {
+    int frames;
+    struct rM_pen_state s;
+  } d;
+};
+struct touch_snapshot {
+  uint seq;
+  struct {
+    int frames;
+    struct rM_touch_state s;
+  } d;
+};
+
+/* The per-source decoders live in the input thread's struct edatas;
+ * active is the source whose frame was delivered last (NULL for none),
+ * for RM_MERGE_LATEST_WINS. */
+struct edata;
+
+#define N_SLOTS RM_N_SLOTS
 struct wacom_data {
   pthread_mutex_t mutex;
-  int pen_down; int touch_down;
-  int abs_x; int abs_y; int abs_pressure;
-  int drop_until_syn;
+  struct edata *active;
   void *userdata;
   uint coord_kind;
+  struct rM_pen_filter filter;
+  uint filter_gen; /* bumped to reset every source's filter state */
+  struct pen_snapshot snap;
 };
 struct touch_data {
   pthread_mutex_t mutex;
-  int slots[N_SLOTS]; /* keep track of the tracking id for each slot */
-  int abs_x[N_SLOTS];
-  int abs_y[N_SLOTS];
-  int current_slot;
+  struct edata *active;
+  struct touch_snapshot snap;
+  /* source 0 only, whatever the merge policy: what injection works on */
+  struct touch_snapshot primary_snap;
+  /* The contacts we are injecting, and the tracking ids for them, are
+   * guarded by inject_mutex rather than mutex, which is held while the
+   * handler runs, so that a handler can itself submit contacts. */
+  pthread_mutex_t inject_mutex;
+  int inject_slots[N_SLOTS];
   /* the kernel currently uses (mt->trkid++ & TRKID_MAX) to get a new
    * tracking id, so we just stay a few thousand ids ahead of the
    * kernel */
 #define TRKID_MAX 0xffff
 #define KERN_TRKID_OFFSET 4096
   uint next_trkid;
-  int drop_until_syn;
   void *userdata;
   uint coord_kind;
 };
 struct key_data {
   pthread_mutex_t mutex;
+  struct edata *active;
   void *userdata;
+  void *frame_userdata;
+  int repeat_fd; /* timerfd, owned by the input thread */
+  int repeat_key; /* -1 when not repeating */
+  struct rM_key_decoder *repeat_on; /* the source repeat_key is on */
+  uint repeat_delay_ms;
+  uint repeat_period_ms; /* 0 to disable autorepeat */
+};
+
+struct ink_data {
+  pthread_mutex_t mutex; /* guards the free lists and growth sizes */
+  struct rM_ink_chunk *free_chunks;
+  struct rM_ink_stroke *free_strokes;
+  uint grow_chunks;
+  uint grow_strokes;
+  /* the rest is under wd.mutex */
+  handle_ink_event_t handle;
+  void *userdata;
+  uint coord_kind;
+  struct rM_ink_stroke *cur;
+  uint next_id;
+};
+
+struct trace_data {
+  int enabled;
+  struct rM_trace_frame *buf; /* allocated once, never freed */
+  uint capacity; /* a power of two */
+  uint64_t head; /* frames ever written */
+  /* of the batch being decoded; input thread only */
+  int64_t t_wake;
+  int64_t t_read;
 };
 
 struct rM_input_devices_priv {
@@ -45,10 +113,17 @@ struct rM_input_devices_priv {
   handle_wacom_event_t hwe;
   handle_touch_event_t hte;
   handle_key_event_t hke;
+  handle_key_frame_t hkf;
   pthread_mutex_t input_thread_mutex;
   int input_thread_running;
+  uint io_engine;
+  uint merge_policy;
+  int frame_source; /* input thread only */
+  int full_kbd_fd; /* see enable_full_keyboard */
   pthread_t input_thread;
   struct wacom_data wd;
   struct touch_data td;
   struct key_data kd;
+  struct trace_data trace;
+  struct ink_data ink;
 };
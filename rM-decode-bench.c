@@ -0,0 +1,111 @@
+/* Throughput of the pure decoders, in events/s, over synthetic but
+ * realistically shaped streams: pen frames (proximity, contact,
+ * x/y/pressure), two-finger touch frames, and key press/release
+ * frames. No I/O or locking is involved.
+ *
+ * usage: rM-decode-bench [seconds_per_decoder] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "rM-input-devices.h"
+
+#define N_EVENTS (1 << 16)
+
+static struct input_event evs[N_EVENTS];
+static long frames;
+
+static void count_pen(void *data, const struct rM_pen_state *s,
+                      const struct input_event *syn) { frames++; }
+static void count_touch(void *data, const struct rM_touch_state *s,
+                        const struct input_event *syn) { frames++; }
+static void count_key(void *data, const struct rM_key_state *s,
+                      const struct input_event *syn) { frames++; }
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+static void ev(int *n, int type, int code, int value) {
+  if (*n < N_EVENTS) {
+    evs[(*n)++] = (struct input_event){ .type = type, .code = code, .value = value };
+  }
+}
+static int fill_pen() {
+  int n = 0;
+  for (int i = 0; n + 6 <= N_EVENTS; ++i) {
+    ev(&n, EV_KEY, BTN_TOOL_PEN, 1);
+    ev(&n, EV_KEY, BTN_TOUCH, (i/100) % 2);
+    ev(&n, EV_ABS, ABS_X, i % 20000);
+    ev(&n, EV_ABS, ABS_Y, (i*3) % 15000);
+    ev(&n, EV_ABS, ABS_PRESSURE, (i*7) % 4096);
+    ev(&n, EV_SYN, SYN_REPORT, 0);
+  }
+  return n;
+}
+static int fill_touch() {
+  int n = 0;
+  for (int i = 0; n + 9 <= N_EVENTS; ++i) {
+    for (int slot = 0; slot < 2; ++slot) {
+      ev(&n, EV_ABS, ABS_MT_SLOT, slot);
+      if (i % 50 == 0) { ev(&n, EV_ABS, ABS_MT_TRACKING_ID, i/50*2 + slot); }
+      ev(&n, EV_ABS, ABS_MT_POSITION_X, (i + slot*300) % 1404);
+      ev(&n, EV_ABS, ABS_MT_POSITION_Y, (i*2 + slot*300) % 1872);
+    }
+    ev(&n, EV_SYN, SYN_REPORT, 0);
+  }
+  return n;
+}
+static int fill_key() {
+  int n = 0;
+  for (int i = 0; n + 2 <= N_EVENTS; ++i) {
+    ev(&n, EV_KEY, KEY_A + (i/2) % 26, !(i % 2));
+    ev(&n, EV_SYN, SYN_REPORT, 0);
+  }
+  return n;
+}
+
+static void report(const char *name, long events, double secs) {
+  printf("%s: %.1fM events/s, %.1fM frames/s\n",
+         name, events/secs/1e6, frames/secs/1e6);
+}
+
+int main(int argc, char **argv) {
+  double budget = argc > 1 ? atof(argv[1]) : 1.0;
+  if (budget <= 0) {
+    fprintf(stderr, "usage: %s [seconds_per_decoder]\n", argv[0]);
+    return 1;
+  }
+  double t0, t;
+  long events;
+  int n;
+
+  struct rM_pen_decoder pd;
+  rm_pen_decoder_init(&pd);
+  n = fill_pen(); frames = 0; events = 0; t0 = now();
+  do {
+    rm_decode_pen_events(&pd, evs, n, count_pen, NULL);
+    events += n;
+  } while ((t = now()) - t0 < budget);
+  report("pen", events, t - t0);
+
+  struct rM_touch_decoder td;
+  rm_touch_decoder_init(&td);
+  n = fill_touch(); frames = 0; events = 0; t0 = now();
+  do {
+    rm_decode_touch_events(&td, evs, n, count_touch, NULL);
+    events += n;
+  } while ((t = now()) - t0 < budget);
+  report("touch", events, t - t0);
+
+  struct rM_key_decoder kd;
+  rm_key_decoder_init(&kd);
+  n = fill_key(); frames = 0; events = 0; t0 = now();
+  do {
+    rm_decode_key_events(&kd, evs, n, count_key, NULL);
+    events += n;
+  } while ((t = now()) - t0 < budget);
+  report("key", events, t - t0);
+  return 0;
+}
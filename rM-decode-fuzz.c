@@ -0,0 +1,275 @@
+/* Randomised checks of the pure decoders. Streams of events, biased
+ * towards the codes the decoders care about (and towards bad values:
+ * negative and out-of-range slots, tracking ids, key values, stray
+ * SYN_DROPPEDs), are decoded both in one call and split into random
+ * chunks. The frames from the two must be the same, must match a
+ * plain per-event model of the device, and must never hold an
+ * inconsistent state:
+ * - pen_down and touch_down are 0 or 1;
+ * - current_slot is -1 or a tracked slot, and every slot is -1 or a
+ *   tracking id >= 0;
+ * - a key frame changes something, and presses, releases and down
+ *   agree with each other and with the previous frame;
+ * - no frame is delivered between a SYN_DROPPED and the SYN_REPORT
+ *   after it, and decoding stops at the SYN_DROPPED with
+ *   resync_needed set.
+ *
+ * usage: rM-decode-fuzz [iterations [seed]] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rM-input-devices.h"
+
+#define MAX_EVENTS 512
+#define MAX_FRAMES MAX_EVENTS
+
+static unsigned long long rng;
+static unsigned rnd(unsigned n) {
+  rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+  return n ? (rng >> 16) % n : 0;
+}
+
+static int iteration;
+static void fail(const char *what) {
+  fprintf(stderr, "iteration %d: %s\n", iteration, what);
+  exit(1);
+}
+
+static struct input_event evs[MAX_EVENTS];
+static int n_evs;
+
+static int random_value() {
+  switch (rnd(8)) {
+    case 0: return -1 - (int)rnd(100);
+    case 1: return (int)(rnd(1u << 31)) - (1 << 30);
+    case 2: return 2;
+    default: return rnd(RM_N_SLOTS + 8);
+  }
+}
+static void random_stream() {
+  static const int abs_codes[] = {
+    ABS_X, ABS_Y, ABS_PRESSURE, ABS_MT_SLOT, ABS_MT_TRACKING_ID,
+    ABS_MT_POSITION_X, ABS_MT_POSITION_Y,
+  };
+  static const int key_codes[] = {
+    BTN_TOOL_PEN, BTN_TOUCH, KEY_A, KEY_LEFTSHIFT, KEY_POWER, KEY_MAX,
+    KEY_MAX + 1,
+  };
+  n_evs = 1 + rnd(MAX_EVENTS);
+  for (int i = 0; i < n_evs; ++i) {
+    struct input_event *e = &evs[i];
+    *e = (struct input_event){ 0 };
+    switch (rnd(10)) {
+      case 0: case 1:
+        e->type = EV_SYN;
+        e->code = rnd(20) ? SYN_REPORT : SYN_DROPPED;
+        break;
+      case 2: case 3: case 4:
+        e->type = EV_KEY;
+        e->code = key_codes[rnd(sizeof(key_codes)/sizeof(int))];
+        e->value = rnd(4) ? rnd(2) : random_value();
+        break;
+      case 9:
+        e->type = rnd(EV_CNT);
+        e->code = rnd(KEY_CNT);
+        e->value = random_value();
+        break;
+      default:
+        e->type = EV_ABS;
+        e->code = abs_codes[rnd(sizeof(abs_codes)/sizeof(int))];
+        e->value = random_value();
+        break;
+    }
+  }
+}
+
+/* Frames as delivered: copies of the state, plus which event ended
+ * them. */
+struct frames {
+  int n;
+  int at[MAX_FRAMES];
+  union {
+    struct rM_pen_state pen;
+    struct rM_touch_state touch;
+    struct rM_key_state key;
+  } s[MAX_FRAMES];
+};
+static struct frames whole, split, model;
+
+static void check_pen(const struct rM_pen_state *s) {
+  if ((s->pen_down & ~1) || (s->touch_down & ~1)) { fail("pen: bad button state"); }
+}
+static void check_touch(const struct rM_touch_state *s) {
+  if (s->current_slot < -1 || s->current_slot >= RM_N_SLOTS) {
+    fail("touch: current_slot out of range");
+  }
+  for (int i = 0; i < RM_N_SLOTS; ++i) {
+    if (s->slots[i] < -1) { fail("touch: bad tracking id"); }
+  }
+}
+static void check_key(const struct rM_key_state *s, const unsigned char *before) {
+  int any = 0;
+  for (int k = 0; k <= KEY_MAX; ++k) {
+    int down = !!RM_KEY_IS_SET(s->down, k), was = !!RM_KEY_IS_SET(before, k);
+    int p = !!RM_KEY_IS_SET(s->pressed, k), r = !!RM_KEY_IS_SET(s->released, k);
+    any |= p | r | !!RM_KEY_IS_SET(s->repeated, k);
+    if (p && !r && !down) { fail("key: pressed but not down"); }
+    if (r && !p && down) { fail("key: released but down"); }
+    if (!p && !r && down != was) { fail("key: down changed silently"); }
+  }
+  if (!any) { fail("key: empty frame"); }
+}
+
+static const struct input_event *base;
+static void record(struct frames *f, const void *s, size_t size,
+                   const struct input_event *syn) {
+  if (f->n == MAX_FRAMES) { fail("too many frames"); }
+  if (syn->type != EV_SYN || syn->code != SYN_REPORT) { fail("frame not ended by SYN_REPORT"); }
+  f->at[f->n] = syn - base;
+  memcpy(&f->s[f->n++], s, size);
+}
+static void pen_frame(void *f, const struct rM_pen_state *s,
+                      const struct input_event *syn) {
+  check_pen(s);
+  record(f, s, sizeof(*s), syn);
+}
+static void touch_frame(void *f, const struct rM_touch_state *s,
+                        const struct input_event *syn) {
+  check_touch(s);
+  record(f, s, sizeof(*s), syn);
+}
+static unsigned char key_before[RM_KEY_BYTES];
+static void key_frame(void *f, const struct rM_key_state *s,
+                      const struct input_event *syn) {
+  check_key(s, key_before);
+  memcpy(key_before, s->down, RM_KEY_BYTES);
+  record(f, s, sizeof(*s), syn);
+}
+
+/* Decodes evs, split at random points if split is set, and checks the
+ * SYN_DROPPED protocol on the way: a call stops right after one, with
+ * resync_needed set, and never otherwise. */
+#define DECODE(kind, dec, handle, out, do_split)                        \
+  do {                                                                  \
+    (out)->n = 0;                                                       \
+    int off = 0;                                                        \
+    while (off < n_evs) {                                               \
+      int len = (do_split) ? 1 + rnd(n_evs - off) : n_evs - off;        \
+      size_t used = rm_decode_##kind##_events(dec, evs + off, len,      \
+                                              handle, out);             \
+      if (used < 1 || used > (size_t)len) { fail("bad consumed count"); } \
+      const struct input_event *last = &evs[off + used - 1];            \
+      int dropped = last->type == EV_SYN && last->code == SYN_DROPPED;  \
+      if ((dec)->resync_needed != dropped) { fail("resync_needed wrong"); } \
+      if (!dropped && used != (size_t)len) { fail("stopped early"); }   \
+      off += used;                                                      \
+    }                                                                   \
+  } while (0)
+
+/* The model: the same device semantics, applied one event at a time
+ * and written out the long way. */
+static void model_pen() {
+  struct rM_pen_state s = { 0 };
+  int dropping = 0;
+  model.n = 0;
+  for (int i = 0; i < n_evs; ++i) {
+    struct input_event *e = &evs[i];
+    if (e->type == EV_SYN && e->code == SYN_DROPPED) { dropping = 1; continue; }
+    if (e->type == EV_SYN && e->code == SYN_REPORT) {
+      if (dropping) { dropping = 0; continue; }
+      model.at[model.n] = i; model.s[model.n++].pen = s;
+      continue;
+    }
+    if (dropping) { continue; }
+    if (e->type == EV_KEY && e->code == BTN_TOOL_PEN) { s.pen_down = e->value != 0; }
+    if (e->type == EV_KEY && e->code == BTN_TOUCH) { s.touch_down = e->value != 0; }
+    if (e->type == EV_ABS && e->code == ABS_X) { s.abs_x = e->value; }
+    if (e->type == EV_ABS && e->code == ABS_Y) { s.abs_y = e->value; }
+    if (e->type == EV_ABS && e->code == ABS_PRESSURE) { s.abs_pressure = e->value; }
+  }
+}
+static void model_touch() {
+  struct rM_touch_state s = { 0 };
+  for (int i = 0; i < RM_N_SLOTS; ++i) { s.slots[i] = -1; }
+  int dropping = 0;
+  model.n = 0;
+  for (int i = 0; i < n_evs; ++i) {
+    struct input_event *e = &evs[i];
+    if (e->type == EV_SYN && e->code == SYN_DROPPED) { dropping = 1; continue; }
+    if (e->type == EV_SYN && e->code == SYN_REPORT) {
+      if (dropping) { dropping = 0; continue; }
+      model.at[model.n] = i; model.s[model.n++].touch = s;
+      continue;
+    }
+    if (dropping || e->type != EV_ABS) { continue; }
+    int slot = s.current_slot;
+    switch (e->code) {
+      case ABS_MT_SLOT:
+        s.current_slot = e->value >= 0 && e->value < RM_N_SLOTS ? e->value : -1;
+        break;
+      case ABS_MT_TRACKING_ID:
+        if (slot >= 0) { s.slots[slot] = e->value >= 0 ? e->value : -1; }
+        break;
+      case ABS_MT_POSITION_X:
+        if (slot >= 0) { s.abs_x[slot] = e->value; }
+        break;
+      case ABS_MT_POSITION_Y:
+        if (slot >= 0) { s.abs_y[slot] = e->value; }
+        break;
+    }
+  }
+}
+
+static void compare(const struct frames *a, const struct frames *b,
+                    size_t size, const char *what) {
+  if (a->n != b->n) { fail(what); }
+  for (int i = 0; i < a->n; ++i) {
+    if (a->at[i] != b->at[i] || memcmp(&a->s[i], &b->s[i], size)) { fail(what); }
+  }
+}
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+  rng = argc > 2 ? strtoull(argv[2], NULL, 0) : 0x2545f4914f6cdd1dULL;
+  if (!rng) { rng = 1; }
+  base = evs;
+  long n_frames = 0;
+  for (iteration = 0; iteration < iterations; ++iteration) {
+    random_stream();
+
+    struct rM_pen_decoder pd;
+    rm_pen_decoder_init(&pd);
+    DECODE(pen, &pd, pen_frame, &whole, 0);
+    rm_pen_decoder_init(&pd);
+    DECODE(pen, &pd, pen_frame, &split, 1);
+    model_pen();
+    compare(&whole, &split, sizeof(struct rM_pen_state), "pen: split decode differs");
+    compare(&whole, &model, sizeof(struct rM_pen_state), "pen: differs from model");
+    n_frames += whole.n;
+
+    struct rM_touch_decoder td;
+    rm_touch_decoder_init(&td);
+    DECODE(touch, &td, touch_frame, &whole, 0);
+    rm_touch_decoder_init(&td);
+    DECODE(touch, &td, touch_frame, &split, 1);
+    model_touch();
+    compare(&whole, &split, sizeof(struct rM_touch_state), "touch: split decode differs");
+    compare(&whole, &model, sizeof(struct rM_touch_state), "touch: differs from model");
+    n_frames += whole.n;
+
+    /* with no device to resync from, a SYN_DROPPED rolls back to the
+     * last frame, which is what key_before tracks */
+    struct rM_key_decoder kd;
+    rm_key_decoder_init(&kd);
+    memset(key_before, 0, sizeof(key_before));
+    DECODE(key, &kd, key_frame, &whole, 0);
+    rm_key_decoder_init(&kd);
+    memset(key_before, 0, sizeof(key_before));
+    DECODE(key, &kd, key_frame, &split, 1);
+    compare(&whole, &split, sizeof(struct rM_key_state), "key: split decode differs");
+    n_frames += whole.n;
+  }
+  printf("ok: %d streams, %ld frames\n", iterations, n_frames);
+  return 0;
+}
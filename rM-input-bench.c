@@ -0,0 +1,153 @@
+/* Loopback benchmark of the input engines. The same pen frames are
+ * written down a pipe standing in for the digitizer, once per engine
+ * (each in a child process of its own), and timed from the write() to
+ * the handler: first as one burst, for throughput and the input
+ * thread's CPU time, then paced, for latency.
+ *
+ * usage: rM-input-bench [burst_frames [paced_frames [interval_us]]] */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "rM-input-devices.h"
+
+#define FRAMES_PER_WRITE 64
+
+static int64_t now_ns(clockid_t clk) {
+  struct timespec ts;
+  clock_gettime(clk, &ts);
+  return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static int n_frames;
+static int64_t *t_sent, *t_recv;
+static int64_t cpu_first, cpu_last;
+static int received;
+
+/* The frame number travels as ABS_X */
+static void handle_pen(void *data, int pen_down, int touch_down,
+                       int x, int y, int pressure) {
+  if (x < 0 || x >= n_frames) { return; }
+  t_recv[x] = now_ns(CLOCK_MONOTONIC);
+  int64_t cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+  if (!cpu_first) { cpu_first = cpu; }
+  cpu_last = cpu;
+  __atomic_add_fetch(&received, 1, __ATOMIC_RELEASE);
+}
+
+static void fill_frame(struct input_event *e, int seq) {
+  struct input_event f[6] = {
+    { .type = EV_KEY, .code = BTN_TOOL_PEN, .value = 1 },
+    { .type = EV_KEY, .code = BTN_TOUCH, .value = 1 },
+    { .type = EV_ABS, .code = ABS_X, .value = seq },
+    { .type = EV_ABS, .code = ABS_Y, .value = 1000 },
+    { .type = EV_ABS, .code = ABS_PRESSURE, .value = 2000 },
+    { .type = EV_SYN, .code = SYN_REPORT, .value = 0 },
+  };
+  memcpy(e, f, sizeof(f));
+}
+static int wait_for(int n) {
+  int64_t deadline = now_ns(CLOCK_MONOTONIC) + 10000000000LL;
+  while (__atomic_load_n(&received, __ATOMIC_ACQUIRE) < n) {
+    if (now_ns(CLOCK_MONOTONIC) > deadline) { return -1; }
+    usleep(1000);
+  }
+  return 0;
+}
+static int cmp_i64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int run(uint engine, const char *name,
+               int burst, int paced, int interval_us) {
+  struct rM_input_devices ds = find_rm_input_devices(0);
+  if (set_input_io_engine(&ds, engine) != engine) {
+    printf("%s: not built in\n", name);
+    return 0;
+  }
+  int pw[2], pt[2], pk[2];
+  if (pipe(pw) || pipe(pt) || pipe(pk)) { perror("pipe"); return -1; }
+  fcntl(pw[1], F_SETPIPE_SZ, 1 << 20);
+  ds.digitizer = pw[0]; ds.touch = pt[0]; ds.kbd = pk[0];
+  n_frames = burst + paced;
+  t_sent = calloc(n_frames, sizeof(int64_t));
+  t_recv = calloc(n_frames, sizeof(int64_t));
+  struct input_event *evs = calloc(6*FRAMES_PER_WRITE, sizeof(struct input_event));
+  if (!t_sent || !t_recv || !evs) { return -1; }
+  on_wacom_event(&ds, RM_COORD_EVDEVICE, handle_pen, NULL);
+  enable_input_event_listening(&ds);
+  usleep(100000);
+
+  int64_t t0 = now_ns(CLOCK_MONOTONIC);
+  for (int seq = 0; seq < burst; ) {
+    int n = burst - seq < FRAMES_PER_WRITE ? burst - seq : FRAMES_PER_WRITE;
+    for (int i = 0; i < n; ++i) { fill_frame(&evs[6*i], seq+i); }
+    int64_t t = now_ns(CLOCK_MONOTONIC);
+    for (int i = 0; i < n; ++i) { t_sent[seq+i] = t; }
+    if (write(pw[1], evs, 6*n*sizeof(struct input_event)) < 0) { return -1; }
+    seq += n;
+  }
+  if (wait_for(burst) < 0) { printf("%s: burst timed out\n", name); return -1; }
+  int64_t t1 = 0;
+  for (int i = 0; i < burst; ++i) { if (t_recv[i] > t1) { t1 = t_recv[i]; } }
+  int64_t cpu = cpu_last - cpu_first;
+
+  for (int seq = burst; seq < n_frames; ++seq) {
+    fill_frame(evs, seq);
+    t_sent[seq] = now_ns(CLOCK_MONOTONIC);
+    if (write(pw[1], evs, 6*sizeof(struct input_event)) < 0) { return -1; }
+    usleep(interval_us);
+  }
+  if (wait_for(n_frames) < 0) { printf("%s: paced timed out\n", name); return -1; }
+  int64_t *lat = t_recv + burst;
+  for (int i = 0; i < paced; ++i) { lat[i] -= t_sent[burst+i]; }
+  qsort(lat, paced, sizeof(int64_t), cmp_i64);
+
+  double secs = (t1 - t0)/1e9;
+  printf("%s: burst of %d frames in %.3fs (%.0f frames/s, input thread "
+         "cpu %.3fs)", name, burst, secs, burst/secs, cpu/1e9);
+  if (paced) {
+    printf("; %d frames every %dus: latency p50 %.1fus p99 %.1fus "
+           "max %.1fus", paced, interval_us, lat[paced/2]/1e3,
+           lat[paced*99/100]/1e3, lat[paced-1]/1e3);
+  }
+  printf("\n");
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int burst = argc > 1 ? atoi(argv[1]) : 200000;
+  int paced = argc > 2 ? atoi(argv[2]) : 2000;
+  int interval_us = argc > 3 ? atoi(argv[3]) : 1000;
+  if (burst < 1 || paced < 0 || interval_us < 0) {
+    fprintf(stderr, "usage: %s [burst_frames [paced_frames [interval_us]]]\n",
+            argv[0]);
+    return 1;
+  }
+  struct { uint engine; const char *name; } engines[] = {
+    { RM_IO_ENGINE_EPOLL, "epoll" },
+    { RM_IO_ENGINE_IO_URING, "io_uring" },
+  };
+  int ret = 0;
+  for (int i = 0; i < 2; ++i) {
+    /* the input thread never exits, so each engine gets a process */
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      exit(run(engines[i].engine, engines[i].name, burst, paced, interval_us) ? 1 : 0);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status)) {
+      ret = 1;
+    }
+  }
+  return ret;
+}
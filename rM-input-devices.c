@@ -7,6 +7,15 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <stdio.h>
+#ifdef RM_INPUT_IO_URING
+#include <poll.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
 
 #include <linux/uinput.h>
 #include <libudev.h>
@@ -179,6 +188,22 @@ struct input_device kbd = {
   .udev_prop_filter = "ID_INPUT_KEY",
 };
 
+/* A keyboard with every key up to KEY_MICMUTE, for text injection;
+ * its keybits are filled in by enable_full_keyboard. */
+uint full_kbd_keybits[KEY_MICMUTE+1];
+struct input_device full_kbd = {
+  .propbits = 0,
+  .evbits = kbd_evbits,
+  .keybits = full_kbd_keybits,
+  .abs = 0,
+  .setup = {
+    .id = { .bustype = BUS_VIRTUAL, .vendor = 0x0, .product = 0x0, .version = 0x1 },
+    .name = "rM-input-devices keyboard",
+    0
+  },
+  .udev_prop_filter = "ID_INPUT_KEYBOARD",
+};
+
 #define mk_not_empty(n, t) \
   static int not_empty_ ## n(t *n) {            \
     t test = {0};                               \
@@ -308,6 +333,60 @@ static void find_devices(struct input_device devices[], int create_if_missing) {
   }
 }
 
+/* Seqlock: the (single) writer makes seq odd, copies, and makes it even
+ * again; readers retry if they saw it odd or changed. Every word goes
+ * through a relaxed atomic, so a torn copy is only ever thrown away. */
+static void seq_publish(uint *seq, int *dst, const int *src, size_t n) {
+  uint s = *seq;
+  __atomic_store_n(seq, s+1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for (size_t i = 0; i < n; ++i) { __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED); }
+  __atomic_store_n(seq, s+2, __ATOMIC_RELEASE);
+}
+static void seq_read(const uint *seq, int *dst, const int *src, size_t n) {
+  uint s1, s2;
+  do {
+    while ((s1 = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1);
+    for (size_t i = 0; i < n; ++i) { dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED); }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    s2 = __atomic_load_n(seq, __ATOMIC_RELAXED);
+  } while (s1 != s2);
+}
+#define SEQ_INTS(x) (sizeof(x)/sizeof(int))
+static void publish_pen_state(struct pen_snapshot *snap,
+                              const struct rM_pen_state *s) {
+  typeof(snap->d) d = { .frames = snap->d.frames+1, .s = *s };
+  seq_publish(&snap->seq, (int *)&snap->d, (int *)&d, SEQ_INTS(d));
+}
+static void publish_touch_state(struct touch_snapshot *snap,
+                                const struct rM_touch_state *s) {
+  typeof(snap->d) d = { .frames = snap->d.frames+1, .s = *s };
+  seq_publish(&snap->seq, (int *)&snap->d, (int *)&d, SEQ_INTS(d));
+}
+static void read_touch_snapshot(struct touch_snapshot *snap,
+                                struct rM_touch_state *s, int *frames) {
+  typeof(snap->d) d;
+  seq_read(&snap->seq, (int *)&d, (int *)&snap->d, SEQ_INTS(d));
+  *s = d.s;
+  if (frames) { *frames = d.frames; }
+}
+/* with no contacts, before the input thread has looked at the device */
+static void publish_no_touches(struct touch_data *td) {
+  struct rM_touch_decoder empty;
+  rm_touch_decoder_init(&empty);
+  publish_touch_state(&td->snap, &empty.state);
+  publish_touch_state(&td->primary_snap, &empty.state);
+}
+
+#define IO_ENGINE_ENV "RM_INPUT_DEVICES_IO_ENGINE"
+static uint default_io_engine() {
+#ifdef RM_INPUT_IO_URING
+  char *e = getenv(IO_ENGINE_ENV);
+  if (e && !strcmp(e, "io_uring")) { return RM_IO_ENGINE_IO_URING; }
+#endif
+  return RM_IO_ENGINE_EPOLL;
+}
+
 struct rM_input_devices find_rm_input_devices(int create_if_missing) {
   struct input_device devices[] = { digitizer, touch, kbd, 0 };
   find_devices(devices, create_if_missing);
@@ -319,18 +398,30 @@ struct rM_input_devices find_rm_input_devices(int create_if_missing) {
     .hwe = NULL,
     .hte = NULL,
     .hke = NULL,
+    .hkf = NULL,
     .input_thread_mutex = PTHREAD_MUTEX_INITIALIZER,
     .input_thread_running = 0,
+    .io_engine = default_io_engine(),
+    .merge_policy = RM_MERGE_ALL_SOURCES,
+    .frame_source = -1,
+    .full_kbd_fd = -1,
+    .ink = {
+      .mutex = PTHREAD_MUTEX_INITIALIZER,
+    },
     .wd = {
       .mutex = PTHREAD_MUTEX_INITIALIZER
     },
     .td = {
       .mutex = PTHREAD_MUTEX_INITIALIZER,
+      .inject_mutex = PTHREAD_MUTEX_INITIALIZER,
     },
     .kd = {
       .mutex = PTHREAD_MUTEX_INITIALIZER,
+      .repeat_fd = -1,
+      .repeat_key = -1,
     },
   };
+  publish_no_touches(&priv->td);
   struct rM_input_devices ret = {
     .digitizer = devices[0].fds ? devices[0].fds->fd : -1,
     .touch = devices[1].fds ? devices[1].fds->fd : -1,
@@ -344,6 +435,7 @@ enum device_type {
   DEV_WACOM,
   DEV_TOUCH,
   DEV_KEY,
+  DEV_KEY_REPEAT, /* the autorepeat timerfd */
 };
 
 static void wacom_coord_evd_to_disp(int *x, int *y) {
@@ -381,29 +473,393 @@ static void touch_coord_disp_to_evd(int *x, int *y) {
 }
 #endif
 
+/* Pen filters (see struct rM_pen_filter). Everything is integer
+ * arithmetic on Q16 fixed point, with a constant amount of work per
+ * sample. */
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+#define Q16(x) ((int64_t)(x) << 16)
+/* 10^6/(2*pi): the time constant, in us, of a 1Hz low-pass */
+#define EURO_TAU_1HZ_US 159155
+/* keeps a large jump over a short dt from overflowing the Q16 maths */
+#define EURO_MIN_DT_US 500
+#define EURO_MAX_DT_US 100000
+static int64_t euro_alpha(int64_t dt_us, int64_t cutoff) {
+  if (cutoff <= 0) { return 0; }
+  int64_t tau_us = Q16(EURO_TAU_1HZ_US) / cutoff;
+  return Q16(dt_us) / (dt_us + tau_us);
+}
+static int euro_axis(struct pen_filter_state *fs, struct rM_pen_filter *f,
+                     int axis, int v, int64_t dt_us) {
+  int64_t vq = Q16(v);
+  int64_t dv = (vq - fs->v[axis]) * 1000000 / dt_us;
+  fs->dv[axis] += (dv - fs->dv[axis]) *
+    euro_alpha(dt_us, f->one_euro_dcutoff) >> 16;
+  int64_t speed = fs->dv[axis] < 0 ? -fs->dv[axis] : fs->dv[axis];
+  /* beta (Q16 Hz per unit/s) times whole units/s: Q16 Hz already */
+  int64_t cutoff = f->one_euro_min_cutoff +
+    (int64_t)f->one_euro_beta * (speed >> 16);
+  fs->v[axis] += (vq - fs->v[axis]) * euro_alpha(dt_us, cutoff) >> 16;
+  return (fs->v[axis] + (1 << 15)) >> 16;
+}
+static void run_pen_filter(struct rM_pen_filter *f, struct pen_filter_state *fs,
+                           const struct rM_pen_state *s,
+                           const struct input_event *syn,
+                           int *x, int *y, int *p) {
+  int64_t t = (int64_t)syn->input_event_sec*1000000 + syn->input_event_usec;
+  if (!s->pen_down) {
+    /* out of proximity: start afresh when the pen comes back */
+    fs->have = 0;
+    return;
+  }
+  if (f->filters & RM_FILTER_DEADBAND) {
+    if (fs->have && s->touch_down &&
+        abs(*x - fs->db_x) <= (int)f->deadband &&
+        abs(*y - fs->db_y) <= (int)f->deadband) {
+      *x = fs->db_x; *y = fs->db_y;
+    } else {
+      fs->db_x = *x; fs->db_y = *y;
+    }
+  }
+  if (f->filters & RM_FILTER_ONE_EURO) {
+    if (!fs->have) {
+      fs->v[0] = Q16(*x); fs->v[1] = Q16(*y);
+      fs->dv[0] = fs->dv[1] = 0;
+    } else {
+      int64_t dt = t - fs->t;
+      if (dt < EURO_MIN_DT_US) { dt = EURO_MIN_DT_US; }
+      if (dt > EURO_MAX_DT_US) { dt = EURO_MAX_DT_US; }
+      *x = euro_axis(fs, f, 0, *x, dt);
+      *y = euro_axis(fs, f, 1, *y, dt);
+    }
+  }
+  if (f->filters & RM_FILTER_PRESSURE_CURVE) {
+    int in = *p < 0 ? 0 : *p > RM_PRESSURE_MAX ? RM_PRESSURE_MAX : *p;
+    int pos = in * RM_PRESSURE_CURVE_SEGS;
+    int i = pos / RM_PRESSURE_MAX, frac = pos % RM_PRESSURE_MAX;
+    if (i == RM_PRESSURE_CURVE_SEGS) {
+      *p = f->pressure_curve[i];
+    } else {
+      int lo = f->pressure_curve[i], hi = f->pressure_curve[i+1];
+      *p = lo + (hi - lo) * frac / RM_PRESSURE_MAX;
+    }
+  }
+  fs->have = 1;
+  fs->t = t;
+}
+
+/* Ink capture. Strokes are built out of fixed-size chunks from a pool
+ * that only grows when consumers hold on to more than it has, so
+ * that steady writing (with strokes released after use) allocates
+ * nothing. The free lists are shared with rm_ink_stroke_release, which
+ * may be called from any thread, and so have their own mutex. */
+#define INK_DEFAULT_POINTS 4096
+#define INK_DEFAULT_STROKES 8
+/* each list grows on its own, only when it runs out */
+static int ink_grow_chunks(struct ink_data *ink) {
+  struct rM_ink_chunk *cs = calloc(ink->grow_chunks, sizeof(struct rM_ink_chunk));
+  if (!cs) { return -1; }
+  for (uint i = 0; i < ink->grow_chunks; ++i) {
+    cs[i].next = ink->free_chunks;
+    ink->free_chunks = &cs[i];
+  }
+  return 0;
+}
+static int ink_grow_strokes(struct ink_data *ink) {
+  struct rM_ink_stroke *ss = calloc(ink->grow_strokes, sizeof(struct rM_ink_stroke));
+  if (!ss) { return -1; }
+  for (uint i = 0; i < ink->grow_strokes; ++i) {
+    ss[i].next_free = ink->free_strokes;
+    ink->free_strokes = &ss[i];
+  }
+  return 0;
+}
+static struct rM_ink_chunk *ink_alloc_chunk(struct ink_data *ink) {
+  pthread_mutex_lock(&ink->mutex);
+  if (!ink->free_chunks) { ink_grow_chunks(ink); }
+  struct rM_ink_chunk *c = ink->free_chunks;
+  if (c) { ink->free_chunks = c->next; c->next = NULL; c->n = 0; }
+  pthread_mutex_unlock(&ink->mutex);
+  return c;
+}
+static struct rM_ink_stroke *ink_alloc_stroke(struct ink_data *ink) {
+  pthread_mutex_lock(&ink->mutex);
+  if (!ink->free_strokes) { ink_grow_strokes(ink); }
+  struct rM_ink_stroke *st = ink->free_strokes;
+  if (st) { ink->free_strokes = st->next_free; }
+  pthread_mutex_unlock(&ink->mutex);
+  return st;
+}
+static void ink_release(struct ink_data *ink, struct rM_ink_stroke *st) {
+  pthread_mutex_lock(&ink->mutex);
+  if (st->first) {
+    st->last->next = ink->free_chunks;
+    ink->free_chunks = st->first;
+  }
+  st->next_free = ink->free_strokes;
+  ink->free_strokes = st;
+  pthread_mutex_unlock(&ink->mutex);
+}
+/* called with wd->mutex held, for every pen frame */
+static void ink_frame(struct rM_input_devices *ds, const struct rM_pen_state *s,
+                      const struct input_event *syn, int x, int y, int p) {
+  struct ink_data *ink = &ds->priv->ink;
+  struct rM_ink_stroke *st = ink->cur;
+  if (st && st->source != s->source) { return; }
+  if (!s->pen_down || !s->touch_down) {
+    if (st) {
+      ink->cur = NULL;
+      const struct rM_ink_point *latest = st->last ?
+        &st->last->points[st->last->n-1] : NULL;
+      /* from here on, the stroke belongs to the handler */
+      ink->handle(ink->userdata, RM_INK_END, st, latest);
+    }
+    return;
+  }
+  int64_t t = (int64_t)syn->input_event_sec*1000000 + syn->input_event_usec;
+  int what = RM_INK_UPDATE;
+  if (!st) {
+    if (!(st = ink_alloc_stroke(ink))) { return; }
+    *st = (struct rM_ink_stroke){
+      .id = ink->next_id++, .source = s->source, .t_start_us = t,
+    };
+    ink->cur = st;
+    what = RM_INK_BEGIN;
+  }
+  if (!st->last || st->last->n == RM_INK_CHUNK_POINTS) {
+    struct rM_ink_chunk *c = ink_alloc_chunk(ink);
+    if (!c) { return; } /* out of memory: drop the point */
+    if (st->last) { st->last->next = c; } else { st->first = c; }
+    st->last = c;
+  }
+  if (ink->coord_kind & RM_COORD_DISPLAY) { wacom_coord_evd_to_disp(&x, &y); }
+  struct rM_ink_point *pt = &st->last->points[st->last->n++];
+  *pt = (struct rM_ink_point){
+    .x = x, .y = y, .pressure = p, .t_us = t - st->t_start_us,
+  };
+  st->n_points++;
+  ink->handle(ink->userdata, what, st, pt);
+}
+
+/* One per fd the input thread watches. Each device fd is a source,
+ * with decoder state of its own, so that a partial frame from one
+ * device never mixes with another's. */
 struct edata {
   enum device_type dt;
   int fd;
+  struct rM_input_devices *ds;
+  union {
+    struct {
+      struct rM_pen_decoder dec;
+      struct pen_filter_state fs;
+      uint fs_gen; /* see wacom_data.filter_gen */
+      int near; /* its last frame had the pen in proximity */
+    } pen;
+    struct {
+      struct rM_touch_decoder dec;
+      int touching; /* its last frame had contacts */
+    } touch;
+    struct {
+      struct rM_key_decoder dec;
+      int lifted; /* its keys were released for another source's */
+    } key;
+  };
 };
-static struct edata *mk_edata(enum device_type dt, int fd) {
-  struct edata *ret = malloc(sizeof(struct edata));
-  ret->dt = dt;
-  ret->fd = fd;
-  return ret;
+/* Tracing. The input thread is the only writer of the trace ring; an
+ * exporter copies it out and then discards whatever the writer may
+ * have overwritten meanwhile. When tracing is off, all that is left on
+ * the input path is the TRACING() branch. */
+#define TRACING(ds) __builtin_expect(__atomic_load_n(&(ds)->priv->trace.enabled, __ATOMIC_RELAXED), 0)
+#define TRACE_DEFAULT_FRAMES 4096
+static int64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+static void trace_frame(struct rM_input_devices *ds, uint dev, int source,
+                        const struct input_event *syn,
+                        int64_t t_decode, int64_t t_convert) {
+  struct trace_data *tr = &ds->priv->trace;
+  if (!syn) { return; }
+  /* pairs with the release of enabled in rm_input_trace_enable, so
+   * that buf and capacity are seen; only paid for while tracing */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  uint64_t h = tr->head;
+  struct rM_trace_frame *f = &tr->buf[h & (tr->capacity-1)];
+  *f = (struct rM_trace_frame){
+    .dev = dev,
+    .source = source,
+    .seq = h,
+    .t_kernel = (int64_t)syn->input_event_sec*1000000000 +
+                (int64_t)syn->input_event_usec*1000,
+    .t_wake = tr->t_wake,
+    .t_read = tr->t_read,
+    .t_decode = t_decode,
+    .t_convert = t_convert,
+    .t_deliver = now_ns(),
+  };
+  __atomic_store_n(&tr->head, h+1, __ATOMIC_RELEASE);
+}
+
+/* The decoders: pure functions of their state and the events given;
+ * all I/O, locking and resyncing is left to the caller. */
+void rm_pen_decoder_init(struct rM_pen_decoder *d) {
+  *d = (struct rM_pen_decoder){ 0 };
+}
+size_t rm_decode_pen_events(struct rM_pen_decoder *d,
+                            const struct input_event *evs, size_t n,
+                            handle_pen_frame_t handle, void *data) {
+  struct rM_pen_state *s = &d->state;
+  d->resync_needed = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const struct input_event *ev = &evs[i];
+    if (ev->type == EV_SYN) {
+      if (ev->code == SYN_DROPPED) {
+        d->drop_until_syn = 1;
+        d->resync_needed = 1;
+        return i+1;
+      }
+      if (ev->code == SYN_REPORT) {
+        if (d->drop_until_syn) { d->drop_until_syn = 0; continue; }
+        if (handle) { handle(data, s, ev); }
+      }
+      continue;
+    }
+    if (d->drop_until_syn) { continue; }
+    if (ev->type == EV_KEY) {
+      if (ev->code == BTN_TOOL_PEN) { s->pen_down = !!ev->value; }
+      if (ev->code == BTN_TOUCH) { s->touch_down = !!ev->value; }
+    }
+    if (ev->type == EV_ABS) {
+      if (ev->code == ABS_X) { s->abs_x = ev->value; }
+      if (ev->code == ABS_Y) { s->abs_y = ev->value; }
+      if (ev->code == ABS_PRESSURE) { s->abs_pressure = ev->value; }
+    }
+  }
+  return n;
+}
+
+void rm_touch_decoder_init(struct rM_touch_decoder *d) {
+  *d = (struct rM_touch_decoder){ 0 };
+  for (int i = 0; i < RM_N_SLOTS; ++i) { d->state.slots[i] = -1; }
 }
-static void handle_wacom_syn_dropped(struct rM_input_devices *ds, int fd) {
+size_t rm_decode_touch_events(struct rM_touch_decoder *d,
+                              const struct input_event *evs, size_t n,
+                              handle_touch_frame_t handle, void *data) {
+  struct rM_touch_state *s = &d->state;
+  d->resync_needed = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const struct input_event *ev = &evs[i];
+    if (ev->type == EV_SYN) {
+      if (ev->code == SYN_DROPPED) {
+        d->drop_until_syn = 1;
+        d->resync_needed = 1;
+        return i+1;
+      }
+      if (ev->code == SYN_REPORT) {
+        if (d->drop_until_syn) { d->drop_until_syn = 0; continue; }
+        if (handle) { handle(data, s, ev); }
+      }
+      continue;
+    }
+    if (d->drop_until_syn || ev->type != EV_ABS) { continue; }
+    if (ev->code == ABS_MT_SLOT) {
+      /* events for a slot we can't track are ignored, not misfiled */
+      s->current_slot = (ev->value >= 0 && ev->value < RM_N_SLOTS) ?
+        ev->value : -1;
+      continue;
+    }
+    if (s->current_slot < 0) { continue; }
+    if (ev->code == ABS_MT_TRACKING_ID) {
+      s->slots[s->current_slot] = ev->value < 0 ? -1 : ev->value;
+    }
+    if (ev->code == ABS_MT_POSITION_X) {
+      s->abs_x[s->current_slot] = ev->value;
+    }
+    if (ev->code == ABS_MT_POSITION_Y) {
+      s->abs_y[s->current_slot] = ev->value;
+    }
+  }
+  return n;
+}
+
+void rm_key_decoder_init(struct rM_key_decoder *d) {
+  *d = (struct rM_key_decoder){ 0 };
+}
+size_t rm_decode_key_events(struct rM_key_decoder *d,
+                            const struct input_event *evs, size_t n,
+                            handle_key_frame_t handle, void *data) {
+  struct rM_key_state *s = &d->state;
+  d->resync_needed = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const struct input_event *ev = &evs[i];
+    if (ev->type == EV_SYN) {
+      if (ev->code == SYN_DROPPED) {
+        /* roll the partial frame back; the resync supersedes it */
+        memcpy(s->down, d->reported, sizeof(s->down));
+        memset(s->pressed, 0, sizeof(s->pressed));
+        memset(s->released, 0, sizeof(s->released));
+        memset(s->repeated, 0, sizeof(s->repeated));
+        d->changed = 0;
+        d->drop_until_syn = 1;
+        d->resync_needed = 1;
+        return i+1;
+      }
+      if (ev->code == SYN_REPORT) {
+        if (d->drop_until_syn) { d->drop_until_syn = 0; continue; }
+        if (!d->changed) { continue; }
+        if (handle) { handle(data, s, ev); }
+        memcpy(d->reported, s->down, sizeof(d->reported));
+        memset(s->pressed, 0, sizeof(s->pressed));
+        memset(s->released, 0, sizeof(s->released));
+        memset(s->repeated, 0, sizeof(s->repeated));
+        d->changed = 0;
+      }
+      continue;
+    }
+    if (d->drop_until_syn || ev->type != EV_KEY || ev->code > KEY_MAX) {
+      continue;
+    }
+    int byte = ev->code/8, bit = 1 << (ev->code%8);
+    if (ev->value == 0) {
+      if (!(s->down[byte] & bit)) { continue; }
+      s->down[byte] &= ~bit;
+      s->released[byte] |= bit;
+    } else if (ev->value == 1) {
+      if (s->down[byte] & bit) { continue; }
+      s->down[byte] |= bit;
+      s->pressed[byte] |= bit;
+    } else {
+      s->repeated[byte] |= bit;
+    }
+    d->changed = 1;
+  }
+  return n;
+}
+
+static uint merge_policy(struct rM_input_devices *ds) {
+  return __atomic_load_n(&ds->priv->merge_policy, __ATOMIC_RELAXED);
+}
+static int source_delivered(struct rM_input_devices *ds, int source) {
+  return source == 0 || merge_policy(ds) != RM_MERGE_PRIMARY_ONLY;
+}
+
+static void handle_wacom_syn_dropped(struct edata *ed) {
+  struct rM_pen_state *s = &ed->pen.dec.state;
   char keybits[SIZE(KEY)] = {0};
-  ioctl(fd, EVIOCGKEY(SIZE(KEY)), &keybits);
-  ds->priv->wd.pen_down = CHECK_BIT(keybits, BTN_TOOL_PEN);
-  ds->priv->wd.touch_down = CHECK_BIT(keybits, BTN_TOUCH);
+  ioctl(ed->fd, EVIOCGKEY(SIZE(KEY)), &keybits);
+  s->pen_down = !!CHECK_BIT(keybits, BTN_TOOL_PEN);
+  s->touch_down = !!CHECK_BIT(keybits, BTN_TOUCH);
   struct input_absinfo abs = {0};
-  ioctl(fd, EVIOCGABS(ABS_X), &abs);
-  ds->priv->wd.abs_x = abs.value;
-  ioctl(fd, EVIOCGABS(ABS_Y), &abs);
-  ds->priv->wd.abs_y = abs.value;
-  ioctl(fd, EVIOCGABS(ABS_PRESSURE), &abs);
-  ds->priv->wd.abs_pressure = abs.value;
-  ds->priv->wd.drop_until_syn = 1;
+  ioctl(ed->fd, EVIOCGABS(ABS_X), &abs);
+  s->abs_x = abs.value;
+  ioctl(ed->fd, EVIOCGABS(ABS_Y), &abs);
+  s->abs_y = abs.value;
+  ioctl(ed->fd, EVIOCGABS(ABS_PRESSURE), &abs);
+  s->abs_pressure = abs.value;
+  ed->pen.dec.drop_until_syn = 1;
 }
 struct input_mt_request_layout {
   __u32 code;
@@ -412,188 +868,693 @@ struct input_mt_request_layout {
 static void update_trkid(struct touch_data *td, int kern_trkid) {
   /* For now, we don't do anything to try to map existing contacts,
    * and just hope that KERN_TRKID_OFFSET is big enough. */
-  if (kern_trkid >= 0 &&
-      /* TODO: fix to actually track what we're using instead of just
-       * bumping if we see something <1/2 the offset */
-      kern_trkid < (td->next_trkid - KERN_TRKID_OFFSET/2)&TRKID_MAX &&
+  if (kern_trkid < 0) { return; }
+  pthread_mutex_lock(&td->inject_mutex);
+  /* TODO: fix to actually track what we're using instead of just
+   * bumping if we see something <1/2 the offset */
+  if (kern_trkid < (td->next_trkid - KERN_TRKID_OFFSET/2)&TRKID_MAX &&
       (kern_trkid + KERN_TRKID_OFFSET)&TRKID_MAX > td->next_trkid) {
     td->next_trkid = (kern_trkid + KERN_TRKID_OFFSET) & TRKID_MAX;
   }
+  pthread_mutex_unlock(&td->inject_mutex);
 }
-static void handle_touch_syn_dropped(struct rM_input_devices *ds, int fd) {
+static void deliver_touches(struct rM_input_devices *ds,
+                            const struct rM_touch_state *s) {
+  struct touch_data *td = &ds->priv->td;
+  publish_touch_state(&td->snap, s);
+  ds->priv->frame_source = s->source;
+  if (!ds->priv->hte) { return; }
+  for (int i = 0; i < N_SLOTS; ++i) {
+    if (s->slots[i] < 0) { continue; }
+    int x = s->abs_x[i]; int y = s->abs_y[i];
+    if (td->coord_kind & RM_COORD_DISPLAY) {
+      touch_coord_evd_to_disp(&x, &y);
+    }
+    ds->priv->hte(td->userdata, s->slots[i], x, y);
+  }
+}
+/* Only the primary touchscreen is injected into, so only its
+ * tracking ids and slots matter to touch_*_contact */
+static void track_primary_touches(struct touch_data *td,
+                                  const struct rM_touch_state *s) {
+  if (s->source != 0) { return; }
+  publish_touch_state(&td->primary_snap, s);
+  for (int i = 0; i < N_SLOTS; ++i) { update_trkid(td, s->slots[i]); }
+}
+/* Under RM_MERGE_LATEST_WINS the touchscreen belongs to one source at
+ * a time. Another takes it over by starting to touch (going from no
+ * contacts to some); the frames of the one it took over from are
+ * dropped until that has let go and starts again. */
+static int touch_source_wins(struct rM_input_devices *ds, struct edata *ed,
+                             const struct rM_touch_state *s) {
+  struct touch_data *td = &ds->priv->td;
+  int touching = 0;
+  for (int i = 0; i < N_SLOTS; ++i) { touching |= s->slots[i] >= 0; }
+  int began = touching && !ed->touch.touching;
+  ed->touch.touching = touching;
+  if (!source_delivered(ds, s->source)) { return 0; }
+  if (merge_policy(ds) == RM_MERGE_LATEST_WINS && td->active &&
+      td->active != ed && !began) {
+    return 0;
+  }
+  td->active = ed;
+  return 1;
+}
+static void handle_touch_syn_dropped(struct edata *ed) {
+  struct rM_input_devices *ds = ed->ds;
+  struct rM_touch_state *s = &ed->touch.dec.state;
   struct input_mt_request_layout imrl_id, imrl_x, imrl_y;
+  /* if the ioctls fail, come back with no contacts */
+  memset(imrl_id.values, 0xff, sizeof(imrl_id.values));
+  memset(imrl_x.values, 0, sizeof(imrl_x.values));
+  memset(imrl_y.values, 0, sizeof(imrl_y.values));
   imrl_id.code = ABS_MT_TRACKING_ID;
-  ioctl(fd, EVIOCGMTSLOTS(sizeof(imrl_id)), &imrl_id);
+  ioctl(ed->fd, EVIOCGMTSLOTS(sizeof(imrl_id)), &imrl_id);
   imrl_x.code = ABS_MT_POSITION_X;
-  ioctl(fd, EVIOCGMTSLOTS(sizeof(imrl_x)), &imrl_x);
+  ioctl(ed->fd, EVIOCGMTSLOTS(sizeof(imrl_x)), &imrl_x);
   imrl_y.code = ABS_MT_POSITION_Y;
-  ioctl(fd, EVIOCGMTSLOTS(sizeof(imrl_y)), &imrl_y);
+  ioctl(ed->fd, EVIOCGMTSLOTS(sizeof(imrl_y)), &imrl_y);
   for (int i = 0; i < N_SLOTS; ++i) {
-    ds->priv->td.slots[i] = imrl_id.values[i];
-    update_trkid(&ds->priv->td, imrl_id.values[i]);
-    ds->priv->td.abs_x[i] = imrl_x.values[i];
-    ds->priv->td.abs_y[i] = imrl_y.values[i];
-    if (ds->priv->hte && imrl_id.values[i] >= 0) {
-      int x = imrl_x.values[i], y = imrl_y.values[i];
-      if (ds->priv->td.coord_kind & RM_COORD_DISPLAY) {
-        touch_coord_evd_to_disp(&x, &y);
-      }
-      ds->priv->hte(ds->priv->td.userdata, imrl_id.values[i], x, y);
-    }
+    s->slots[i] = imrl_id.values[i] < 0 ? -1 : imrl_id.values[i];
+    s->abs_x[i] = imrl_x.values[i];
+    s->abs_y[i] = imrl_y.values[i];
   }
-  struct input_absinfo abs;
-  ioctl(fd, EVIOCGABS(ABS_MT_SLOT), &abs);
-  ds->priv->td.current_slot = abs.value;
-  ds->priv->td.drop_until_syn = 1;
+  struct input_absinfo abs = {0};
+  ioctl(ed->fd, EVIOCGABS(ABS_MT_SLOT), &abs);
+  s->current_slot = (abs.value >= 0 && abs.value < N_SLOTS) ? abs.value : -1;
+  ed->touch.dec.drop_until_syn = 1;
+  track_primary_touches(&ds->priv->td, s);
+  if (touch_source_wins(ds, ed, s)) { deliver_touches(ds, s); }
 }
-static void handle_wacom_event(struct rM_input_devices *ds, int fd) {
-  struct input_event ev;
+static void deliver_wacom_frame(struct rM_input_devices *ds, struct edata *ed,
+                                const struct rM_pen_state *s,
+                                const struct input_event *syn,
+                                int64_t t_decode) {
   struct wacom_data *wd = &ds->priv->wd;
-  pthread_mutex_lock(&wd->mutex);
-  while (read(fd, &ev, sizeof(struct input_event)) == sizeof(struct input_event)) {
-    if (ev.type == EV_SYN) {
-      if (ev.code == SYN_DROPPED) { handle_wacom_syn_dropped(ds, fd); }
-      if (ev.code == SYN_REPORT) {
-        if (wd->drop_until_syn) { wd->drop_until_syn = 0; continue; }
-        if (ds->priv->hwe) {
-          int x = wd->abs_x; int y = wd->abs_y;
-          if (wd->coord_kind & RM_COORD_DISPLAY) {
-            wacom_coord_evd_to_disp(&x, &y);
-          }
-          ds->priv->hwe(wd->userdata, wd->pen_down, wd->touch_down,
-                        x, y, wd->abs_pressure);
-        }
-      }
-    }
-    if (wd->drop_until_syn) { continue; }
-    if (ev.type == EV_KEY) {
-      if (ev.code == BTN_TOOL_PEN) { wd->pen_down = ev.value; }
-      if (ev.code == BTN_TOUCH) { wd->touch_down = ev.value; }
-    }
-    if (ev.type == EV_ABS) {
-      if (ev.code == ABS_X) { wd->abs_x = ev.value; }
-      if (ev.code == ABS_Y) { wd->abs_y = ev.value; }
-      if (ev.code == ABS_PRESSURE) { wd->abs_pressure = ev.value; }
+  wd->active = ed;
+  ds->priv->frame_source = s->source;
+  publish_pen_state(&wd->snap, s);
+  if (!ds->priv->hwe && !ds->priv->ink.handle) { return; }
+  int x = s->abs_x; int y = s->abs_y; int p = s->abs_pressure;
+  if (wd->filter.filters) {
+    if (ed->pen.fs_gen != wd->filter_gen) {
+      ed->pen.fs = (struct pen_filter_state){ 0 };
+      ed->pen.fs_gen = wd->filter_gen;
     }
+    run_pen_filter(&wd->filter, &ed->pen.fs, s, syn, &x, &y, &p);
+  }
+  if (ds->priv->ink.handle) { ink_frame(ds, s, syn, x, y, p); }
+  if (!ds->priv->hwe) { return; }
+  if (wd->coord_kind & RM_COORD_DISPLAY) {
+    wacom_coord_evd_to_disp(&x, &y);
+  }
+  int64_t t_convert = t_decode ? now_ns() : 0;
+  ds->priv->hwe(wd->userdata, s->pen_down, s->touch_down, x, y, p);
+  if (t_decode) { trace_frame(ds, RM_TRACE_PEN, s->source, syn, t_decode, t_convert); }
+}
+static void dispatch_wacom_frame(void *ed_, const struct rM_pen_state *s,
+                                 const struct input_event *syn) {
+  struct edata *ed = ed_;
+  struct rM_input_devices *ds = ed->ds;
+  struct edata *active = ds->priv->wd.active;
+  int64_t t_decode = TRACING(ds) ? now_ns() : 0;
+  ed->pen.near = s->pen_down;
+  if (!source_delivered(ds, s->source)) { return; }
+  /* under RM_MERGE_LATEST_WINS, the pen stays with its source until
+   * it leaves proximity */
+  if (merge_policy(ds) == RM_MERGE_LATEST_WINS && active && active != ed &&
+      active->pen.near) {
+    return;
+  }
+  deliver_wacom_frame(ds, ed, s, syn, t_decode);
+}
+static void handle_wacom_events(struct edata *ed,
+                                struct input_event *evs, int n) {
+  struct wacom_data *wd = &ed->ds->priv->wd;
+  pthread_mutex_lock(&wd->mutex);
+  while (n > 0) {
+    int used = rm_decode_pen_events(&ed->pen.dec, evs, n, dispatch_wacom_frame, ed);
+    if (ed->pen.dec.resync_needed) { handle_wacom_syn_dropped(ed); }
+    evs += used; n -= used;
   }
   pthread_mutex_unlock(&wd->mutex);
 }
-static void handle_touch_event(struct rM_input_devices *ds, int fd) {
-  struct input_event ev;
-  struct touch_data *td = &ds->priv->td;
+static void dispatch_touch_frame(void *ed_, const struct rM_touch_state *s,
+                                 const struct input_event *syn) {
+  struct edata *ed = ed_;
+  struct rM_input_devices *ds = ed->ds;
+  int tracing = TRACING(ds);
+  int64_t t_decode = tracing ? now_ns() : 0;
+  track_primary_touches(&ds->priv->td, s);
+  if (!touch_source_wins(ds, ed, s)) { return; }
+  deliver_touches(ds, s);
+  if (tracing) { trace_frame(ds, RM_TRACE_TOUCH, s->source, syn, t_decode, t_decode); }
+}
+static void handle_touch_events(struct edata *ed,
+                                struct input_event *evs, int n) {
+  struct touch_data *td = &ed->ds->priv->td;
   pthread_mutex_lock(&td->mutex);
-  while (read(fd, &ev, sizeof(struct input_event)) == sizeof(struct input_event)) {
-    if (ev.type == EV_SYN) {
-      if (ev.code == SYN_DROPPED) { handle_touch_syn_dropped(ds, fd); }
-      if (ev.code == SYN_REPORT) {
-        if (td->drop_until_syn) { td->drop_until_syn = 0; continue; }
-        if (ds->priv->hte) {
-          for (int i = 0; i < N_SLOTS; ++i) {
-            if (td->slots[i] >= 0) {
-              int x = td->abs_x[i]; int y = td->abs_y[i];
-              if (td->coord_kind & RM_COORD_DISPLAY) {
-                touch_coord_evd_to_disp(&x, &y);
-              }
-              ds->priv->hte(td->userdata, td->slots[i], x, y);
-            }
-          }
+  while (n > 0) {
+    int used = rm_decode_touch_events(&ed->touch.dec, evs, n, dispatch_touch_frame, ed);
+    if (ed->touch.dec.resync_needed) { handle_touch_syn_dropped(ed); }
+    evs += used; n -= used;
+  }
+  pthread_mutex_unlock(&td->mutex);
+}
+/* Autorepeat follows the most recently pressed key, like a console */
+static void arm_key_repeat(struct key_data *kd, struct rM_key_decoder *on,
+                           int key) {
+  kd->repeat_key = key;
+  kd->repeat_on = on;
+  if (kd->repeat_fd < 0) { return; }
+  struct itimerspec its = {0};
+  if (key >= 0) {
+    its.it_value.tv_sec = kd->repeat_delay_ms/1000;
+    its.it_value.tv_nsec = (kd->repeat_delay_ms%1000)*1000000;
+    its.it_interval.tv_sec = kd->repeat_period_ms/1000;
+    its.it_interval.tv_nsec = (kd->repeat_period_ms%1000)*1000000;
+  }
+  timerfd_settime(kd->repeat_fd, 0, &its, NULL);
+}
+static void track_key_repeat(struct key_data *kd, struct edata *ed,
+                             const struct rM_key_state *s) {
+  if (!kd->repeat_period_ms) { return; }
+  int pressed = -1;
+  for (int byte = 0; byte < RM_KEY_BYTES; ++byte) {
+    /* a key pressed and released within the frame isn't held */
+    unsigned char held = s->pressed[byte] & s->down[byte];
+    if (!held) { continue; }
+    for (int bit = 0; bit < 8; ++bit) {
+      if (held & (1 << bit)) { pressed = byte*8+bit; }
+    }
+  }
+  if (pressed >= 0) {
+    arm_key_repeat(kd, &ed->key.dec, pressed);
+  } else if (kd->repeat_key >= 0 && kd->repeat_on == &ed->key.dec &&
+             RM_KEY_IS_SET(s->released, kd->repeat_key)) {
+    arm_key_repeat(kd, NULL, -1);
+  }
+}
+static void deliver_key_frame(struct rM_input_devices *ds,
+                              const struct rM_key_state *s,
+                              const struct input_event *syn) {
+  struct key_data *kd = &ds->priv->kd;
+  ds->priv->frame_source = s->source;
+  if (ds->priv->hkf) { ds->priv->hkf(kd->frame_userdata, s, syn); }
+  if (!ds->priv->hke) { return; }
+  /* releases first, so that a consumer never sees a chord grow
+   * through a key that has already gone up; but a key that went both
+   * ways within the frame is released after its press if it ended up,
+   * so that it isn't left stuck down */
+  unsigned char early[RM_KEY_BYTES], late[RM_KEY_BYTES];
+  for (int byte = 0; byte < RM_KEY_BYTES; ++byte) {
+    late[byte] = s->pressed[byte] & s->released[byte] & ~s->down[byte];
+    early[byte] = s->released[byte] & ~late[byte];
+  }
+  const unsigned char *sets[] = { early, s->pressed, late, s->repeated };
+  const int values[] = { 0, 1, 0, 2 };
+  for (int v = 0; v < 4; ++v) {
+    for (int byte = 0; byte < RM_KEY_BYTES; ++byte) {
+      if (!sets[v][byte]) { continue; }
+      for (int bit = 0; bit < 8; ++bit) {
+        if (sets[v][byte] & (1 << bit)) {
+          ds->priv->hke(kd->userdata, byte*8+bit, values[v]);
         }
       }
     }
-    if (td->drop_until_syn) { continue; }
-    if (ev.type == EV_ABS) {
-      if (ev.code == ABS_MT_SLOT) {
-        td->current_slot = ev.value;
-      }
-      if (ev.code == ABS_MT_TRACKING_ID) {
-        td->slots[td->current_slot] = ev.value;
-        update_trkid(td, ev.value);
-      }
-      if (ev.code == ABS_MT_POSITION_X) {
-        td->abs_x[td->current_slot] = ev.value;
-      }
-      if (ev.code == ABS_MT_POSITION_Y) {
-        td->abs_y[td->current_slot] = ev.value;
-      }
+  }
+}
+static void dispatch_key_frame(void *ed_, const struct rM_key_state *s,
+                               const struct input_event *syn) {
+  struct edata *ed = ed_;
+  struct rM_input_devices *ds = ed->ds;
+  struct key_data *kd = &ds->priv->kd;
+  struct edata *prev = kd->active;
+  int tracing = TRACING(ds);
+  int64_t t_decode = tracing ? now_ns() : 0;
+  if (!source_delivered(ds, s->source)) { return; }
+  if (merge_policy(ds) == RM_MERGE_LATEST_WINS && prev && prev != ed) {
+    /* release whatever the last source was reported to hold down */
+    struct rM_key_state up = { .source = prev->key.dec.state.source };
+    int any = 0;
+    for (int i = 0; i < RM_KEY_BYTES; ++i) {
+      any |= up.released[i] = prev->key.dec.reported[i];
+    }
+    if (any) {
+      track_key_repeat(kd, prev, &up);
+      deliver_key_frame(ds, &up, syn);
     }
+    prev->key.lifted = 1;
   }
-  pthread_mutex_unlock(&td->mutex);
+  if (ed->key.lifted) {
+    /* and when a source comes back, press again what it still holds
+     * (as of its last frame; this one follows) */
+    struct rM_key_state again = { .source = s->source };
+    int any = 0;
+    for (int i = 0; i < RM_KEY_BYTES; ++i) {
+      any |= again.pressed[i] = again.down[i] = ed->key.dec.reported[i];
+    }
+    if (any) { deliver_key_frame(ds, &again, syn); }
+    ed->key.lifted = 0;
+  }
+  kd->active = ed;
+  track_key_repeat(kd, ed, s);
+  deliver_key_frame(ds, s, syn);
+  if (tracing) { trace_frame(ds, RM_TRACE_KEY, s->source, syn, t_decode, t_decode); }
 }
-static void handle_key_event(struct rM_input_devices *ds, int fd) {
-  struct input_event ev;
-  pthread_mutex_lock(&ds->priv->kd.mutex);
-  while (read(fd, &ev, sizeof(struct input_event)) == sizeof(struct input_event)) {
-    /* TODO: we should wait for SYN_REPORT (and handle SYN_DROPPED) */
-    if (ev.type == EV_KEY) {
-      if (ds->priv->hke) {
-        ds->priv->hke(ds->priv->kd.userdata, ev.code, ev.value);
+static void load_key_state(int fd, unsigned char *down) {
+  memset(down, 0, RM_KEY_BYTES);
+  ioctl(fd, EVIOCGKEY(RM_KEY_BYTES), down);
+}
+/* After a SYN_DROPPED: reload the key state from the kernel, and
+ * report the difference as a frame of its own, so that no key is left
+ * stuck down (or up) */
+static void handle_key_syn_dropped(struct edata *ed,
+                                   const struct input_event *syn) {
+  struct rM_key_state *s = &ed->key.dec.state;
+  unsigned char down[RM_KEY_BYTES];
+  load_key_state(ed->fd, down);
+  int changed = 0;
+  for (int i = 0; i < RM_KEY_BYTES; ++i) {
+    s->pressed[i] = down[i] & ~s->down[i];
+    s->released[i] = s->down[i] & ~down[i];
+    s->down[i] = down[i];
+    changed |= s->pressed[i] | s->released[i];
+  }
+  if (changed) { dispatch_key_frame(ed, s, syn); }
+  memcpy(ed->key.dec.reported, s->down, sizeof(s->down));
+  memset(s->pressed, 0, sizeof(s->pressed));
+  memset(s->released, 0, sizeof(s->released));
+}
+static void handle_key_events(struct edata *ed,
+                              struct input_event *evs, int n) {
+  struct key_data *kd = &ed->ds->priv->kd;
+  pthread_mutex_lock(&kd->mutex);
+  while (n > 0) {
+    int used = rm_decode_key_events(&ed->key.dec, evs, n, dispatch_key_frame, ed);
+    if (ed->key.dec.resync_needed) { handle_key_syn_dropped(ed, &evs[used-1]); }
+    evs += used; n -= used;
+  }
+  pthread_mutex_unlock(&kd->mutex);
+}
+static void handle_key_repeat(struct rM_input_devices *ds) {
+  struct key_data *kd = &ds->priv->kd;
+  pthread_mutex_lock(&kd->mutex);
+  int key = kd->repeat_key;
+  const struct rM_key_decoder *on = kd->repeat_on;
+  if (key >= 0 && on && RM_KEY_IS_SET(on->reported, key)) {
+    /* from the last frame delivered, not the decoder's state, which
+     * may hold half of the next one */
+    struct rM_key_state s = { .source = on->state.source };
+    memcpy(s.down, on->reported, sizeof(s.down));
+    s.repeated[key/8] = 1 << (key%8);
+    deliver_key_frame(ds, &s, NULL);
+  } else if (key >= 0) {
+    arm_key_repeat(kd, NULL, -1);
+  }
+  pthread_mutex_unlock(&kd->mutex);
+}
+/* Loads a source's state from its device as the input thread starts,
+ * so that one that is already busy (a pen in proximity, a finger or a
+ * key down) is picked up from there */
+static void resync_source(struct edata *ed) {
+  struct rM_input_devices_priv *priv = ed->ds->priv;
+  switch (ed->dt) {
+    case DEV_WACOM:
+      pthread_mutex_lock(&priv->wd.mutex);
+      handle_wacom_syn_dropped(ed);
+      ed->pen.dec.drop_until_syn = 0;
+      if (source_delivered(ed->ds, ed->pen.dec.state.source)) {
+        publish_pen_state(&priv->wd.snap, &ed->pen.dec.state);
       }
+      pthread_mutex_unlock(&priv->wd.mutex);
+      break;
+    case DEV_TOUCH:
+      pthread_mutex_lock(&priv->td.mutex);
+      handle_touch_syn_dropped(ed);
+      ed->touch.dec.drop_until_syn = 0;
+      pthread_mutex_unlock(&priv->td.mutex);
+      break;
+    case DEV_KEY:
+      pthread_mutex_lock(&priv->kd.mutex);
+      load_key_state(ed->fd, ed->key.dec.state.down);
+      memcpy(ed->key.dec.reported, ed->key.dec.state.down, RM_KEY_BYTES);
+      pthread_mutex_unlock(&priv->kd.mutex);
+      break;
+    case DEV_KEY_REPEAT:
+      break;
+  }
+}
+static void handle_events(struct edata *ed, struct input_event *evs, int n) {
+  switch (ed->dt) {
+    case DEV_WACOM:
+      handle_wacom_events(ed, evs, n);
+      break;
+    case DEV_TOUCH:
+      handle_touch_events(ed, evs, n);
+      break;
+    case DEV_KEY:
+      handle_key_events(ed, evs, n);
+      break;
+    case DEV_KEY_REPEAT:
+      break;
+  }
+}
+/* Drain an fd a batch of events per read() rather than one at a time,
+ * but only READS_PER_WAKE batches before going on to the other ready
+ * fds, so that one device's backlog doesn't hold up the rest; the fd
+ * is still readable, so epoll comes back to it. */
+#define READ_BATCH 64
+#define READS_PER_WAKE 4
+static void read_events(struct rM_input_devices *ds, struct edata *ed) {
+  struct input_event evs[READ_BATCH];
+  ssize_t r;
+  int reads = 0;
+  if (ed->dt == DEV_KEY_REPEAT) {
+    uint64_t expirations;
+    if (read(ed->fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+      handle_key_repeat(ds);
     }
+    return;
+  }
+  while (reads++ < READS_PER_WAKE &&
+         (r = read(ed->fd, evs, sizeof(evs))) >=
+         (ssize_t)sizeof(struct input_event)) {
+    if (TRACING(ds)) { ds->priv->trace.t_read = now_ns(); }
+    handle_events(ed, evs, r/sizeof(struct input_event));
   }
-  pthread_mutex_unlock(&ds->priv->kd.mutex);
 }
-static int add_epoll_event(int epfd, int fd, enum device_type t) {
-  struct epoll_event ev;
-  ev.events = EPOLLIN;
+
+static void init_source(struct edata *ed, int source) {
+  switch (ed->dt) {
+    case DEV_WACOM:
+      rm_pen_decoder_init(&ed->pen.dec);
+      ed->pen.dec.state.source = source;
+      break;
+    case DEV_TOUCH:
+      rm_touch_decoder_init(&ed->touch.dec);
+      ed->touch.dec.state.source = source;
+      ed->touch.touching = 0;
+      break;
+    case DEV_KEY:
+      rm_key_decoder_init(&ed->key.dec);
+      ed->key.dec.state.source = source;
+      ed->key.lifted = 0;
+      break;
+    case DEV_KEY_REPEAT:
+      break;
+  }
+}
+static struct edata *collect_edata(struct rM_input_devices *ds, int *n) {
+  int count = 3 + (ds->priv->kd.repeat_fd >= 0);
+  struct fd_list *lists[] = {
+    ds->priv->extra_wacom_fds,
+    ds->priv->extra_touch_fds,
+    ds->priv->extra_key_fds,
+  };
+  int primaries[] = { ds->digitizer, ds->touch, ds->kbd };
+  for (int t = 0; t < 3; ++t) {
+    for (struct fd_list *f = lists[t]; f; f = f->next) { count++; }
+  }
+  struct edata *eds = malloc(count*sizeof(struct edata));
+  if (!eds) { return NULL; }
+  int i = 0;
+  for (int t = 0; t < 3; ++t) {
+    int source = 0;
+    eds[i] = (struct edata){ .dt = DEV_WACOM+t, .fd = primaries[t], .ds = ds };
+    init_source(&eds[i++], source++);
+    for (struct fd_list *f = lists[t]; f; f = f->next) {
+      eds[i] = (struct edata){ .dt = DEV_WACOM+t, .fd = f->fd, .ds = ds };
+      init_source(&eds[i++], source++);
+    }
+  }
+  if (ds->priv->kd.repeat_fd >= 0) {
+    eds[i++] = (struct edata){
+      .dt = DEV_KEY_REPEAT, .fd = ds->priv->kd.repeat_fd, .ds = ds,
+    };
+  }
+  *n = count;
+  return eds;
+}
+
+static int set_nonblocking(int fd) {
   int flags;
   if ((flags = fcntl(fd, F_GETFL, 0)) < 0) { flags = 0; }
-  if (fcntl(fd, F_SETFL, flags|O_NONBLOCK) < 0) { return -1; }
-  ev.data.ptr = mk_edata(t, fd);
-  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) { return -1; }
+  return fcntl(fd, F_SETFL, flags|O_NONBLOCK);
+}
+static int add_epoll_event(int epfd, struct edata *ed) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  if (set_nonblocking(ed->fd) < 0) { return -1; }
+  ev.data.ptr = ed;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, ed->fd, &ev) == -1) { return -1; }
+  return 0;
+}
+static void run_epoll_loop(struct rM_input_devices *ds, int epfd) {
+  while (1) {
+#define MAX_EVENTS 16
+    struct epoll_event events[MAX_EVENTS];
+    int nfds = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (TRACING(ds)) { ds->priv->trace.t_wake = now_ns(); }
+    if (nfds == -1) {
+      pthread_mutex_lock(&ds->priv->input_thread_mutex);
+      ds->priv->input_thread_running = 0;
+      pthread_mutex_unlock(&ds->priv->input_thread_mutex);
+    }
+    for (int n = 0; n < nfds; ++n) {
+      read_events(ds, (struct edata *)events[n].data.ptr);
+    }
+  }
+}
+
+#ifdef RM_INPUT_IO_URING
+/* A minimal raw io_uring (no liburing dependency). Each input fd keeps
+ * exactly one read pre-posted into its own registered buffer, which
+ * is re-armed as soon as its completion has been decoded, so a busy
+ * device costs one io_uring_enter per wakeup instead of an epoll_wait
+ * plus a read() per batch. evdev has no nowait reads, so the fds are
+ * made nonblocking: an empty device then fails the read inline with
+ * EAGAIN, and is re-armed with a POLL_ADD, rather than having the read
+ * parked on an io-wq worker thread. */
+struct uring {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring; size_t sq_ring_sz;
+  void *cq_ring; size_t cq_ring_sz;
+  size_t sqes_sz;
+  unsigned to_submit;
+  int fixed; /* buffers are registered; use READ_FIXED */
+  struct input_event *bufs;
+  struct iovec *iovs;
+};
+#define URING_POLL_TAG (1ULL << 32)
+
+static void uring_free(struct uring *r) {
+  if (r->sqes && r->sqes != MAP_FAILED) { munmap(r->sqes, r->sqes_sz); }
+  if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) {
+    munmap(r->cq_ring, r->cq_ring_sz);
+  }
+  if (r->sq_ring && r->sq_ring != MAP_FAILED) { munmap(r->sq_ring, r->sq_ring_sz); }
+  if (r->fd >= 0) { close(r->fd); }
+  free(r->bufs);
+  free(r->iovs);
+}
+static int uring_init(struct uring *r, int nfds) {
+  *r = (struct uring){ .fd = -1 };
+  struct io_uring_params p = {0};
+  unsigned entries = 8;
+  while (entries < (unsigned)nfds) { entries <<= 1; }
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0) { return -1; }
+
+  r->sq_entries = p.sq_entries;
+  r->sq_ring_sz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  r->cq_ring_sz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  int single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && r->cq_ring_sz > r->sq_ring_sz) { r->sq_ring_sz = r->cq_ring_sz; }
+  r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED) { goto fail; }
+  r->cq_ring = single ? r->sq_ring :
+    mmap(NULL, r->cq_ring_sz, PROT_READ|PROT_WRITE,
+         MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  if (r->cq_ring == MAP_FAILED) { goto fail; }
+  r->sqes_sz = p.sq_entries*sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_sz, PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) { goto fail; }
+
+  char *sq = r->sq_ring, *cq = r->cq_ring;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  r->bufs = calloc(nfds*READ_BATCH, sizeof(struct input_event));
+  r->iovs = calloc(nfds, sizeof(struct iovec));
+  if (!r->bufs || !r->iovs) { goto fail; }
+  for (int i = 0; i < nfds; ++i) {
+    r->iovs[i].iov_base = r->bufs + i*READ_BATCH;
+    r->iovs[i].iov_len = READ_BATCH*sizeof(struct input_event);
+  }
+  /* registered buffers count against RLIMIT_MEMLOCK on older kernels;
+   * plain readv is still far better than epoll+read, so don't fail */
+  r->fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                     r->iovs, nfds) == 0;
+  return 0;
+
+fail:
+  uring_free(r);
+  return -1;
+}
+static struct io_uring_sqe *uring_sqe(struct uring *r) {
+  unsigned tail = *r->sq_tail;
+  if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+    return NULL;
+  }
+  struct io_uring_sqe *sqe = &r->sqes[tail & *r->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+static void uring_commit(struct uring *r) {
+  unsigned tail = *r->sq_tail;
+  unsigned idx = tail & *r->sq_mask;
+  r->sq_array[idx] = idx;
+  __atomic_store_n(r->sq_tail, tail+1, __ATOMIC_RELEASE);
+  r->to_submit++;
+}
+static int uring_queue_read(struct uring *r, int i, int fd) {
+  struct io_uring_sqe *sqe = uring_sqe(r);
+  if (!sqe) { return -1; }
+  sqe->fd = fd;
+  if (r->fixed) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->addr = (unsigned long)r->iovs[i].iov_base;
+    sqe->len = r->iovs[i].iov_len;
+    sqe->buf_index = i;
+  } else {
+    sqe->opcode = IORING_OP_READV;
+    sqe->addr = (unsigned long)&r->iovs[i];
+    sqe->len = 1;
+  }
+  sqe->user_data = i;
+  uring_commit(r);
+  return 0;
+}
+static int uring_queue_poll(struct uring *r, int i, int fd) {
+  struct io_uring_sqe *sqe = uring_sqe(r);
+  if (!sqe) { return -1; }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll_events = POLLIN;
+  sqe->user_data = i | URING_POLL_TAG;
+  uring_commit(r);
   return 0;
 }
+static void run_uring_loop(struct rM_input_devices *ds, struct uring *r,
+                           struct edata *eds, int n) {
+  int live = 0;
+  for (int i = 0; i < n; ++i) {
+    set_nonblocking(eds[i].fd);
+    if (uring_queue_read(r, i, eds[i].fd) == 0) { live++; }
+  }
+  while (live > 0) {
+    int ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, 1,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR) { continue; }
+      break;
+    }
+    if (TRACING(ds)) {
+      /* the completions carry the data; there is no separate read */
+      ds->priv->trace.t_wake = ds->priv->trace.t_read = now_ns();
+    }
+    r->to_submit -= ret;
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      int i = cqe->user_data & ~URING_POLL_TAG;
+      int res = cqe->res;
+      head++;
+      int requeued;
+      if (cqe->user_data & URING_POLL_TAG) {
+        /* the fd was nonblocking; now it's readable */
+        requeued = (res >= 0 || res == -EINTR) ?
+          uring_queue_read(r, i, eds[i].fd) : -1;
+      } else if (eds[i].dt == DEV_KEY_REPEAT && res == sizeof(uint64_t)) {
+        handle_key_repeat(ds);
+        requeued = uring_queue_read(r, i, eds[i].fd);
+      } else if (res >= (int)sizeof(struct input_event)) {
+        handle_events(&eds[i], r->iovs[i].iov_base,
+                      res/sizeof(struct input_event));
+        requeued = uring_queue_read(r, i, eds[i].fd);
+      } else if (res == -EAGAIN) {
+        requeued = uring_queue_poll(r, i, eds[i].fd);
+      } else if (res == -EINTR) {
+        requeued = uring_queue_read(r, i, eds[i].fd);
+      } else {
+        requeued = -1; /* EOF or a dead fd: stop watching it */
+      }
+      if (requeued < 0) { live--; }
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_lock(&ds->priv->input_thread_mutex);
+  ds->priv->input_thread_running = 0;
+  pthread_mutex_unlock(&ds->priv->input_thread_mutex);
+}
+#endif
+
 static void *run_input_thread(void *ds_) {
   struct rM_input_devices *ds = (struct rM_input_devices *)ds_;
   pthread_mutex_lock(&ds->priv->input_thread_mutex);
   if (ds->priv->input_thread_running) { goto err; }
 
-  int epfd = epoll_create(3);
+  pthread_mutex_lock(&ds->priv->kd.mutex);
+  ds->priv->kd.repeat_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  pthread_mutex_unlock(&ds->priv->kd.mutex);
+  int n;
+  struct edata *eds = collect_edata(ds, &n);
+  if (!eds) { goto err; }
 
-  if (add_epoll_event(epfd, ds->digitizer, DEV_WACOM) < 0) { goto err; }
-  for (struct fd_list *f = ds->priv->extra_wacom_fds; f; f = f->next) {
-    if (add_epoll_event(epfd, f->fd, DEV_WACOM) < 0) { goto err; }
-  }
-  if (add_epoll_event(epfd, ds->touch, DEV_TOUCH) < 0) { goto err; }
-  for (struct fd_list *f = ds->priv->extra_touch_fds; f; f = f->next) {
-    if (add_epoll_event(epfd, f->fd, DEV_TOUCH) < 0) { goto err; }
+  int use_uring = 0;
+#ifdef RM_INPUT_IO_URING
+  struct uring ring;
+  if (ds->priv->io_engine == RM_IO_ENGINE_IO_URING) {
+    /* falls back to epoll on kernels without io_uring (< 5.1) */
+    use_uring = uring_init(&ring, n) == 0;
   }
-  if (add_epoll_event(epfd, ds->kbd, DEV_KEY) < 0) { goto err; }
-  for (struct fd_list *f = ds->priv->extra_key_fds; f; f = f->next) {
-    if (add_epoll_event(epfd, f->fd, DEV_KEY) < 0) { goto err; }
+#endif
+
+  int epfd = -1;
+  if (!use_uring) {
+    epfd = epoll_create(3);
+    for (int i = 0; i < n; ++i) {
+      if (add_epoll_event(epfd, &eds[i]) < 0) { goto err; }
+    }
   }
 
   ds->priv->input_thread_running = 1;
   pthread_mutex_unlock(&ds->priv->input_thread_mutex);
 
-  handle_wacom_syn_dropped(ds, ds->digitizer);
-  ds->priv->wd.drop_until_syn = 0;
-  handle_touch_syn_dropped(ds, ds->touch);
-  ds->priv->td.drop_until_syn = 0;
+  for (int i = 0; i < n; ++i) { resync_source(&eds[i]); }
 
-  while (1) {
-#define MAX_EVENTS 5
-    struct epoll_event events[MAX_EVENTS];
-    int nfds = epoll_wait(epfd, events, MAX_EVENTS, -1);
-    if (nfds == -1) {
-      pthread_mutex_lock(&ds->priv->input_thread_mutex);
-      ds->priv->input_thread_running = 0;
-      pthread_mutex_unlock(&ds->priv->input_thread_mutex);
-    }
-    for (int n = 0; n < nfds; ++n) {
-      struct edata *ed = (struct edata *)events[n].data.ptr;
-      switch (ed->dt) {
-        case DEV_WACOM:
-          handle_wacom_event(ds, ed->fd);
-          break;
-        case DEV_TOUCH:
-          handle_touch_event(ds, ed->fd);
-          break;
-        case DEV_KEY:
-          handle_key_event(ds, ed->fd);
-          break;
-      }
-    }
+#ifdef RM_INPUT_IO_URING
+  if (use_uring) {
+    run_uring_loop(ds, &ring, eds, n);
+    uring_free(&ring);
+    return NULL;
   }
+#endif
+  run_epoll_loop(ds, epfd);
 
   return NULL;
 
@@ -602,15 +1563,43 @@ err:
   return NULL;
 }
 
+int set_input_io_engine(struct rM_input_devices *ds, uint engine) {
+  pthread_mutex_lock(&ds->priv->input_thread_mutex);
+#ifdef RM_INPUT_IO_URING
+  if (engine != RM_IO_ENGINE_IO_URING) { engine = RM_IO_ENGINE_EPOLL; }
+#else
+  engine = RM_IO_ENGINE_EPOLL;
+#endif
+  ds->priv->io_engine = engine;
+  pthread_mutex_unlock(&ds->priv->input_thread_mutex);
+  return engine;
+}
+
+int set_input_merge_policy(struct rM_input_devices *ds, uint policy) {
+  if (policy != RM_MERGE_LATEST_WINS && policy != RM_MERGE_PRIMARY_ONLY) {
+    policy = RM_MERGE_ALL_SOURCES;
+  }
+  __atomic_store_n(&ds->priv->merge_policy, policy, __ATOMIC_RELAXED);
+  return policy;
+}
+int rm_input_frame_source(struct rM_input_devices *ds) {
+  return ds->priv->frame_source;
+}
+
 int enable_input_event_listening(struct rM_input_devices *ds) {
   pthread_mutex_lock(&ds->priv->input_thread_mutex);
   if (ds->priv->input_thread_running) { return 0; }
   pthread_mutex_unlock(&ds->priv->input_thread_mutex);
-  for (int i = 0; i < 32; ++i) {
-    ds->priv->td.slots[i] = -1;
-  }
-  ds->priv->td.current_slot = -1;
+  ds->priv->wd.active = NULL;
+  ds->priv->td.active = NULL;
+  ds->priv->kd.active = NULL;
+  ds->priv->kd.repeat_key = -1;
+  ds->priv->kd.repeat_on = NULL;
+  publish_no_touches(&ds->priv->td);
+  pthread_mutex_lock(&ds->priv->td.inject_mutex);
+  for (int i = 0; i < N_SLOTS; ++i) { ds->priv->td.inject_slots[i] = -1; }
   ds->priv->td.next_trkid = 1; /* will be updated next time we see an event from the kernel */
+  pthread_mutex_unlock(&ds->priv->td.inject_mutex);
   int ret = pthread_create(&ds->priv->input_thread, NULL, run_input_thread, ds);
   if (!ret) { return ret; }
 }
@@ -658,43 +1647,63 @@ int submit_wacom_event(struct rM_input_devices *ds,
 }
 int on_wacom_event(struct rM_input_devices *ds, uint coord_kind,
                    handle_wacom_event_t handle, void *data) {
+  return on_filtered_wacom_event(ds, coord_kind, NULL, handle, data);
+}
+int on_filtered_wacom_event(struct rM_input_devices *ds, uint coord_kind,
+                            const struct rM_pen_filter *filter,
+                            handle_wacom_event_t handle, void *data) {
   pthread_mutex_lock(&ds->priv->wd.mutex);
   ds->priv->hwe = handle;
   ds->priv->wd.userdata = data;
   ds->priv->wd.coord_kind = coord_kind;
+  if (filter) {
+    ds->priv->wd.filter = *filter;
+  } else {
+    ds->priv->wd.filter = (struct rM_pen_filter){ 0 };
+  }
+  ds->priv->wd.filter_gen++;
   pthread_mutex_unlock(&ds->priv->wd.mutex);
+  return 0;
 }
 
+static int find_inject_slot(struct touch_data *td, int c) {
+  for (int i = N_SLOTS-1; i >= 0; --i) {
+    if (td->inject_slots[i] == c) { return i; }
+  }
+  return -1;
+}
 int touch_begin_contact(struct rM_input_devices *ds) {
   struct touch_data *td = &ds->priv->td;
-  pthread_mutex_lock(&td->mutex);
+  struct rM_touch_state cur;
+  read_touch_snapshot(&td->primary_snap, &cur, NULL);
+  pthread_mutex_lock(&td->inject_mutex);
   int id = td->next_trkid;
   td->next_trkid = (id+1)&TRKID_MAX;
 
   int slot = -1;
-  for (int i = N_SLOTS; i >= 0; --i) {
-    if (td->slots[i] < 0) { slot = i; break; }
+  for (int i = N_SLOTS-1; i >= 0; --i) {
+    if (td->inject_slots[i] < 0 && cur.slots[i] < 0) { slot = i; break; }
   }
-  if (slot < 0) { pthread_mutex_unlock(&td->mutex); return -1; /* out of slots */ }
-  td->slots[slot] = id;
+  if (slot < 0) { pthread_mutex_unlock(&td->inject_mutex); return -1; /* out of slots */ }
+  td->inject_slots[slot] = id;
 
-  pthread_mutex_unlock(&td->mutex);
+  pthread_mutex_unlock(&td->inject_mutex);
   return id;
 }
 int submit_touch_contact(struct rM_input_devices *ds, int c,
                          struct rM_coord coord, int which) {
   if (c < 0) { return -1; }
   struct touch_data *td = &ds->priv->td;
-  pthread_mutex_lock(&td->mutex);
   int x = coord.x; int y = coord.y;
   if (coord.coord_kind & RM_COORD_DISPLAY) {
     touch_coord_disp_to_evd(&x, &y);
   }
-  int slot = -1;
-  for (int i = N_SLOTS; i >= 0; --i) {
-    if (td->slots[i] == c) { slot = i; break; }
-  }
-  if (slot < 0) { pthread_mutex_unlock(&td->mutex); return -1; }
+  pthread_mutex_lock(&td->inject_mutex);
+  int slot = find_inject_slot(td, c);
+  pthread_mutex_unlock(&td->inject_mutex);
+  if (slot < 0) { return -1; }
+  struct rM_touch_state cur;
+  read_touch_snapshot(&td->primary_snap, &cur, NULL);
   /* Set slot, set tracking id, set x/y, syn report, set tracking id, set slot */
   struct input_event ies[6] = {0};
   int next = 0;
@@ -711,34 +1720,44 @@ int submit_touch_contact(struct rM_input_devices *ds, int c,
     ies[next].value = y; next++;
   }
   ies[next].type = EV_ABS; ies[next].code = ABS_MT_SLOT;
-  ies[next].value = td->current_slot; next++;
+  ies[next].value = cur.current_slot; next++;
   ies[next].type = EV_SYN; ies[next].code = SYN_REPORT; ies[next].value = 0;
   next++;
-  pthread_mutex_unlock(&td->mutex);
   return write(ds->touch, ies, sizeof(struct input_event)*next);
 }
 int touch_end_contact(struct rM_input_devices *ds, int c) {
-struct touch_data *td = &ds->priv->td;
-  pthread_mutex_lock(&td->mutex);
-
-  int slot = -1;
-  for (int i = N_SLOTS; i >= 0; --i) {
-    if (td->slots[i] == c) { slot = i; break; }
-  }
-  if (slot < 0) { pthread_mutex_unlock(&td->mutex); return -1; }
+  struct touch_data *td = &ds->priv->td;
+  pthread_mutex_lock(&td->inject_mutex);
+  int slot = find_inject_slot(td, c);
+  if (slot >= 0) { td->inject_slots[slot] = -1; }
+  pthread_mutex_unlock(&td->inject_mutex);
+  if (slot < 0) { return -1; }
 
+  struct rM_touch_state cur;
+  read_touch_snapshot(&td->primary_snap, &cur, NULL);
   struct input_event ies[4] = {
     { .type = EV_ABS, .code = ABS_MT_SLOT, .value = slot },
     { .type = EV_ABS, .code = ABS_MT_TRACKING_ID, .value = -1 },
-    { .type = EV_ABS, .code = ABS_MT_SLOT, .value = td->current_slot },
+    { .type = EV_ABS, .code = ABS_MT_SLOT, .value = cur.current_slot },
     { .type = EV_SYN, .code = SYN_REPORT, .value = 0 },
   };
-  td->slots[slot] = -1;
-
-  pthread_mutex_unlock(&td->mutex);
   return write(ds->touch, ies, sizeof(ies));
-
 }
+int rm_input_get_pen_state(struct rM_input_devices *ds,
+                           struct rM_pen_state *state) {
+  struct pen_snapshot *snap = &ds->priv->wd.snap;
+  typeof(snap->d) d;
+  seq_read(&snap->seq, (int *)&d, (int *)&snap->d, SEQ_INTS(d));
+  *state = d.s;
+  return d.frames;
+}
+int rm_input_get_touch_state(struct rM_input_devices *ds,
+                             struct rM_touch_state *state) {
+  int frames;
+  read_touch_snapshot(&ds->priv->td.snap, state, &frames);
+  return frames;
+}
+
 int on_touch_event(struct rM_input_devices *ds, uint coord_kind,
                    handle_touch_event_t handle, void *data) {
   pthread_mutex_lock(&ds->priv->td.mutex);
@@ -761,4 +1780,702 @@ int on_key_event(struct rM_input_devices *ds,
   ds->priv->hke = handle;
   ds->priv->kd.userdata = data;
   pthread_mutex_unlock(&ds->priv->kd.mutex);
+  return 0;
+}
+int on_key_frame(struct rM_input_devices *ds,
+                 handle_key_frame_t handle, void *data) {
+  pthread_mutex_lock(&ds->priv->kd.mutex);
+  ds->priv->hkf = handle;
+  ds->priv->kd.frame_userdata = data;
+  pthread_mutex_unlock(&ds->priv->kd.mutex);
+  return 0;
+}
+int set_key_repeat(struct rM_input_devices *ds, uint delay_ms, uint period_ms) {
+  struct key_data *kd = &ds->priv->kd;
+  pthread_mutex_lock(&kd->mutex);
+  /* a zero it_value would disarm the timer rather than fire at once */
+  kd->repeat_delay_ms = delay_ms ? delay_ms : period_ms;
+  kd->repeat_period_ms = period_ms;
+  arm_key_repeat(kd, NULL, -1);
+  pthread_mutex_unlock(&kd->mutex);
+  return 0;
+}
+
+
+/* Injection batching: frames are accumulated and written to the
+ * device a batch at a time. uinput and evdev both accept any number
+ * of events per write(), but each write lands in every reader's evdev
+ * buffer at once, and that can be as small as 64 events. */
+#define FRAME_BATCH_EVENTS 64
+struct frame_batch {
+  int fd;
+  int n;
+  int err;
+  struct input_event evs[FRAME_BATCH_EVENTS];
+};
+static void batch_flush(struct frame_batch *b) {
+  if (!b->n) { return; }
+  if (write(b->fd, b->evs, sizeof(struct input_event)*b->n) < 0) { b->err = 1; }
+  b->n = 0;
+}
+/* make sure the next frame (of at most max events) fits */
+static void batch_reserve(struct frame_batch *b, int max) {
+  if (b->n + max > FRAME_BATCH_EVENTS) { batch_flush(b); }
+}
+static void batch_ev(struct frame_batch *b, int type, int code, int value) {
+  b->evs[b->n++] = (struct input_event){
+    .type = type, .code = code, .value = value
+  };
+}
+
+/* Frame k of a paced sequence is due at start + k*period_ns; frames
+ * that are already late are left in the batch, so a sender that falls
+ * behind catches up with larger writes (of at most a batch). */
+struct pacer {
+  struct timespec start;
+  uint64_t period_ns;
+};
+static void pacer_init(struct pacer *p, uint64_t period_ns) {
+  p->period_ns = period_ns;
+  clock_gettime(CLOCK_MONOTONIC, &p->start);
+}
+static void pacer_wait(struct pacer *p, struct frame_batch *b, uint64_t k) {
+  if (!p->period_ns) { return; }
+  uint64_t ns = p->start.tv_nsec + k*p->period_ns;
+  struct timespec due = {
+    .tv_sec = p->start.tv_sec + ns/1000000000,
+    .tv_nsec = ns%1000000000,
+  };
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec > due.tv_sec ||
+      (now.tv_sec == due.tv_sec && now.tv_nsec >= due.tv_nsec)) { return; }
+  batch_flush(b);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+}
+
+/* Path sampling. Samples are spread over the segments in proportion to
+ * their (estimated) length, and each segment is stepped with forward
+ * differences in Q32, so producing a sample costs a few additions and
+ * no storage beyond the iterator. Their truncation error grows as the
+ * cube of the steps taken, so every PATH_RESEED_STEPS steps they are
+ * recomputed from the polynomial itself, which keeps any sample within
+ * a thousandth of a unit of the curve however many there are. */
+static int64_t isqrt64(int64_t v) {
+  if (v <= 0) { return 0; }
+  int64_t r = 0, bit = (int64_t)1 << 62;
+  while (bit > v) { bit >>= 2; }
+  while (bit) {
+    if (v >= r + bit) { v -= r + bit; r = (r >> 1) + bit; }
+    else { r >>= 1; }
+    bit >>= 2;
+  }
+  return r;
+}
+static int64_t dist(struct rM_point a, struct rM_point b) {
+  int64_t dx = b.x - a.x, dy = b.y - a.y;
+  return isqrt64(dx*dx + dy*dy);
+}
+#define Q32(x) ((int64_t)(x) * ((int64_t)1 << 32))
+struct path_iter {
+  const struct rM_path *path;
+  int seg; int nsegs;
+  int64_t len_total; int64_t len_done;
+  int steps_total; int steps_done;
+  int step; int nsteps;
+  struct rM_point end; /* of the current segment */
+  struct rM_point last; /* most recent sample */
+  int64_t co[2][4]; /* the segment's a*t^3 + b*t^2 + c*t + p0, per axis */
+  int64_t f[2], df[2], ddf[2], dddf[2];
+};
+#define PATH_RESEED_STEPS 256
+static int path_nsegs(const struct rM_path *path) {
+  if (!path->n_points) { return 0; }
+  if (path->kind == RM_PATH_CUBIC) { return (path->n_points-1)/3; }
+  return path->n_points-1;
+}
+/* a cubic path needs 3k+1 points, k >= 1 */
+static int path_valid(const struct rM_path *path) {
+  if (!path->n_points) { return 0; }
+  if (path->kind == RM_PATH_CUBIC) {
+    return path->n_points >= 4 && (path->n_points-1)%3 == 0;
+  }
+  return 1;
+}
+static const struct rM_point *path_seg(const struct rM_path *path, int i) {
+  return path->kind == RM_PATH_CUBIC ? &path->points[3*i] : &path->points[i];
+}
+static int64_t seg_len(const struct rM_path *path, int i) {
+  const struct rM_point *p = path_seg(path, i);
+  if (path->kind != RM_PATH_CUBIC) { return dist(p[0], p[1]) + 1; }
+  /* the average of the chord and the control polygon */
+  return (dist(p[0], p[3]) +
+          dist(p[0], p[1]) + dist(p[1], p[2]) + dist(p[2], p[3]))/2 + 1;
+}
+static void path_iter_seg(struct path_iter *it) {
+  for (; it->seg < it->nsegs; it->seg++) {
+    it->len_done += seg_len(it->path, it->seg);
+    int end = (it->steps_total*it->len_done + it->len_total/2)/it->len_total;
+    it->nsteps = end - it->steps_done;
+    if (it->nsteps <= 0) { continue; }
+    it->step = 0;
+    const struct rM_point *p = path_seg(it->path, it->seg);
+    it->end = it->path->kind == RM_PATH_CUBIC ? p[3] : p[1];
+    for (int axis = 0; axis < 2; ++axis) {
+#define AXIS(pt) (axis ? (pt).y : (pt).x)
+      int64_t p0 = AXIS(p[0]), a = 0, b = 0, c = AXIS(it->end) - p0;
+      if (it->path->kind == RM_PATH_CUBIC) {
+        int64_t p1 = AXIS(p[1]), p2 = AXIS(p[2]), p3 = AXIS(p[3]);
+        a = -p0 + 3*p1 - 3*p2 + p3;
+        b = 3*p0 - 6*p1 + 3*p2;
+        c = -3*p0 + 3*p1;
+      }
+#undef AXIS
+      it->co[axis][0] = a; it->co[axis][1] = b;
+      it->co[axis][2] = c; it->co[axis][3] = p0;
+    }
+    return;
+  }
+}
+/* x*u, with x and u in Q32 and 0 <= u <= 1 */
+static int64_t mul_q32(int64_t x, int64_t u) {
+  uint64_t lo = (uint64_t)x & 0xffffffff;
+  return (x >> 32)*u + (int64_t)((lo*(uint64_t)u) >> 32);
+}
+/* The differences at step s (t = s/n, h = 1/n) are
+ *   P(t) = ((a*t + b)*t + c)*t + p0
+ *   d    = (a*(3t^2 + 3t*h + h^2) + b*(2t + h) + c) * h
+ *   dd   = (a*(6t + 6h) + 2b) * h^2
+ *   ddd  = 6a * h^3
+ * all of which are computed from t itself, rather than by summing
+ * up s steps. */
+static void path_iter_reseed(struct path_iter *it) {
+  int64_t n = it->nsteps;
+  int64_t t = Q32(it->step)/n, h = Q32(1)/n;
+  for (int axis = 0; axis < 2; ++axis) {
+    int64_t a = it->co[axis][0], b = it->co[axis][1];
+    int64_t c = it->co[axis][2], p0 = it->co[axis][3];
+    it->f[axis] = mul_q32(mul_q32(a*t + Q32(b), t) + Q32(c), t) + Q32(p0);
+    int64_t t2 = 3*mul_q32(t, t) + 3*t/n + h/n;
+    it->df[axis] = (a*t2 + b*(2*t + h) + Q32(c))/n;
+    it->ddf[axis] = (a*(6*t + 6*h) + Q32(2*b))/(n*n);
+    it->dddf[axis] = Q32(6*a)/(n*n*n);
+  }
+}
+static void path_iter_init(struct path_iter *it, const struct rM_path *path,
+                           int nsamples) {
+  *it = (struct path_iter){ .path = path, .nsegs = path_nsegs(path) };
+  it->steps_total = nsamples - 1;
+  for (int i = 0; i < it->nsegs; ++i) { it->len_total += seg_len(path, i); }
+  if (path->n_points) { it->last = path->points[0]; }
+  path_iter_seg(it);
+}
+/* sample 0 is the first point; every later call takes one step */
+static struct rM_point path_iter_next(struct path_iter *it, int first) {
+  if (first || it->seg >= it->nsegs) { return it->last; }
+  if (it->step % PATH_RESEED_STEPS == 0) { path_iter_reseed(it); }
+  for (int axis = 0; axis < 2; ++axis) {
+    it->f[axis] += it->df[axis];
+    it->df[axis] += it->ddf[axis];
+    it->ddf[axis] += it->dddf[axis];
+  }
+  struct rM_point ret = {
+    .x = (it->f[0] + ((int64_t)1 << 31)) >> 32,
+    .y = (it->f[1] + ((int64_t)1 << 31)) >> 32,
+  };
+  if (++it->step == it->nsteps) {
+    /* land exactly on the segment's end point */
+    ret = it->end;
+    it->steps_done += it->nsteps;
+    it->seg++;
+    path_iter_seg(it);
+  }
+  it->last = ret;
+  return ret;
+}
+
+/* keeps n^3 (in path_iter_reseed) within an int64_t */
+#define STROKE_MAX_SAMPLES (1 << 20)
+static int stroke_nsamples(const struct rM_stroke_timing *t) {
+  uint64_t n = (uint64_t)t->duration_ms*t->rate_hz/1000;
+  return n < 2 ? 2 : n > STROKE_MAX_SAMPLES ? STROKE_MAX_SAMPLES : n;
+}
+static uint64_t stroke_period_ns(const struct rM_stroke_timing *t) {
+  return (t->unpaced || !t->rate_hz) ? 0 : 1000000000ULL/t->rate_hz;
+}
+static int stroke_pressure(const int *pressure, uint n_pressure, int k, int n) {
+  if (!pressure || !n_pressure) { return RM_PRESSURE_MAX/2; }
+  if (n_pressure == 1 || n < 2) { return pressure[0]; }
+  int64_t pos = (int64_t)k*(n_pressure-1);
+  int i = pos/(n-1), frac = pos%(n-1);
+  if (i >= (int)n_pressure-1) { return pressure[n_pressure-1]; }
+  return pressure[i] + (int64_t)(pressure[i+1]-pressure[i])*frac/(n-1);
+}
+
+int submit_wacom_stroke(struct rM_input_devices *ds, const struct rM_path *path,
+                        const int *pressure, uint n_pressure,
+                        const struct rM_stroke_timing *timing) {
+  if (!path_valid(path)) { return -1; }
+  int n = stroke_nsamples(timing);
+  struct path_iter it;
+  path_iter_init(&it, path, n);
+  struct frame_batch b = { .fd = ds->digitizer };
+  struct pacer pace;
+  pacer_init(&pace, stroke_period_ns(timing));
+  for (int k = 0; k < n; ++k) {
+    struct rM_point pt = path_iter_next(&it, k == 0);
+    int x = pt.x, y = pt.y;
+    if (path->coord_kind & RM_COORD_DISPLAY) { wacom_coord_disp_to_evd(&x, &y); }
+    pacer_wait(&pace, &b, k);
+    batch_reserve(&b, 6);
+    if (k == 0) {
+      batch_ev(&b, EV_KEY, BTN_TOOL_PEN, 1);
+      batch_ev(&b, EV_KEY, BTN_TOUCH, 1);
+    }
+    batch_ev(&b, EV_ABS, ABS_X, x);
+    batch_ev(&b, EV_ABS, ABS_Y, y);
+    batch_ev(&b, EV_ABS, ABS_PRESSURE,
+             stroke_pressure(pressure, n_pressure, k, n));
+    batch_ev(&b, EV_SYN, SYN_REPORT, 0);
+    if (!pace.period_ns) { batch_flush(&b); }
+  }
+  pacer_wait(&pace, &b, n);
+  batch_reserve(&b, 5);
+  batch_ev(&b, EV_KEY, BTN_TOUCH, 0);
+  batch_ev(&b, EV_ABS, ABS_PRESSURE, 0);
+  batch_ev(&b, EV_SYN, SYN_REPORT, 0);
+  batch_ev(&b, EV_KEY, BTN_TOOL_PEN, 0);
+  batch_ev(&b, EV_SYN, SYN_REPORT, 0);
+  batch_flush(&b);
+  return b.err ? -1 : 0;
+}
+
+int submit_touch_strokes(struct rM_input_devices *ds,
+                         const struct rM_path *paths, uint n_paths,
+                         const struct rM_stroke_timing *timing) {
+  if (!n_paths || n_paths > N_SLOTS) { return -1; }
+  struct touch_data *td = &ds->priv->td;
+  int ids[N_SLOTS], slots[N_SLOTS];
+  for (uint c = 0; c < n_paths; ++c) {
+    if (!path_valid(&paths[c]) || (ids[c] = touch_begin_contact(ds)) < 0) {
+      for (uint i = 0; i < c; ++i) { touch_end_contact(ds, ids[i]); }
+      return -1;
+    }
+  }
+  pthread_mutex_lock(&td->inject_mutex);
+  for (uint c = 0; c < n_paths; ++c) { slots[c] = find_inject_slot(td, ids[c]); }
+  pthread_mutex_unlock(&td->inject_mutex);
+  struct rM_touch_state cur;
+  read_touch_snapshot(&td->primary_snap, &cur, NULL);
+  int cur_slot = cur.current_slot;
+
+  int n = stroke_nsamples(timing);
+  struct path_iter its[N_SLOTS];
+  for (uint c = 0; c < n_paths; ++c) { path_iter_init(&its[c], &paths[c], n); }
+  struct frame_batch b = { .fd = ds->touch };
+  struct pacer pace;
+  pacer_init(&pace, stroke_period_ns(timing));
+  for (int k = 0; k < n; ++k) {
+    pacer_wait(&pace, &b, k);
+    batch_reserve(&b, 4*n_paths + 2);
+    for (uint c = 0; c < n_paths; ++c) {
+      struct rM_point pt = path_iter_next(&its[c], k == 0);
+      int x = pt.x, y = pt.y;
+      if (paths[c].coord_kind & RM_COORD_DISPLAY) { touch_coord_disp_to_evd(&x, &y); }
+      batch_ev(&b, EV_ABS, ABS_MT_SLOT, slots[c]);
+      batch_ev(&b, EV_ABS, ABS_MT_TRACKING_ID, ids[c]);
+      batch_ev(&b, EV_ABS, ABS_MT_POSITION_X, x);
+      batch_ev(&b, EV_ABS, ABS_MT_POSITION_Y, y);
+    }
+    batch_ev(&b, EV_ABS, ABS_MT_SLOT, cur_slot);
+    batch_ev(&b, EV_SYN, SYN_REPORT, 0);
+    if (!pace.period_ns) { batch_flush(&b); }
+  }
+  pacer_wait(&pace, &b, n);
+  batch_reserve(&b, 2*n_paths + 2);
+  pthread_mutex_lock(&td->inject_mutex);
+  for (uint c = 0; c < n_paths; ++c) {
+    batch_ev(&b, EV_ABS, ABS_MT_SLOT, slots[c]);
+    batch_ev(&b, EV_ABS, ABS_MT_TRACKING_ID, -1);
+    td->inject_slots[slots[c]] = -1;
+  }
+  pthread_mutex_unlock(&td->inject_mutex);
+  batch_ev(&b, EV_ABS, ABS_MT_SLOT, cur_slot);
+  batch_ev(&b, EV_SYN, SYN_REPORT, 0);
+  batch_flush(&b);
+  return b.err ? -1 : 0;
+}
+
+int enable_full_keyboard(struct rM_input_devices *ds) {
+  if (ds->priv->full_kbd_fd >= 0) { return 0; }
+  for (uint k = 1; k <= KEY_MICMUTE; ++k) { full_kbd_keybits[k-1] = k; }
+  int fd = create_device(&full_kbd);
+  if (fd < 0) { return -1; }
+  ds->priv->full_kbd_fd = fd;
+  return 0;
+}
+
+/* Text injection. Each character becomes a chord of modifiers and one
+ * key through a fixed table (a US layout); the chords are streamed
+ * into a frame batch, and modifiers stay held across consecutive
+ * chords that share them. */
+static const struct { unsigned char key; unsigned char mods; } ascii_keys[128] = {
+  [' '] = { KEY_SPACE, 0 },
+  ['-'] = { KEY_MINUS, 0 },
+  ['='] = { KEY_EQUAL, 0 },
+  ['['] = { KEY_LEFTBRACE, 0 },
+  [']'] = { KEY_RIGHTBRACE, 0 },
+  ['\\'] = { KEY_BACKSLASH, 0 },
+  [';'] = { KEY_SEMICOLON, 0 },
+  ['\''] = { KEY_APOSTROPHE, 0 },
+  ['`'] = { KEY_GRAVE, 0 },
+  [','] = { KEY_COMMA, 0 },
+  ['.'] = { KEY_DOT, 0 },
+  ['/'] = { KEY_SLASH, 0 },
+  ['\t'] = { KEY_TAB, 0 },
+  ['\n'] = { KEY_ENTER, 0 },
+  ['\b'] = { KEY_BACKSPACE, 0 },
+  ['\x1b'] = { KEY_ESC, 0 },
+  ['\x7f'] = { KEY_DELETE, 0 },
+  ['1'] = { KEY_1, 0 },
+  ['2'] = { KEY_2, 0 },
+  ['3'] = { KEY_3, 0 },
+  ['4'] = { KEY_4, 0 },
+  ['5'] = { KEY_5, 0 },
+  ['6'] = { KEY_6, 0 },
+  ['7'] = { KEY_7, 0 },
+  ['8'] = { KEY_8, 0 },
+  ['9'] = { KEY_9, 0 },
+  ['0'] = { KEY_0, 0 },
+  ['a'] = { KEY_A, 0 },
+  ['b'] = { KEY_B, 0 },
+  ['c'] = { KEY_C, 0 },
+  ['d'] = { KEY_D, 0 },
+  ['e'] = { KEY_E, 0 },
+  ['f'] = { KEY_F, 0 },
+  ['g'] = { KEY_G, 0 },
+  ['h'] = { KEY_H, 0 },
+  ['i'] = { KEY_I, 0 },
+  ['j'] = { KEY_J, 0 },
+  ['k'] = { KEY_K, 0 },
+  ['l'] = { KEY_L, 0 },
+  ['m'] = { KEY_M, 0 },
+  ['n'] = { KEY_N, 0 },
+  ['o'] = { KEY_O, 0 },
+  ['p'] = { KEY_P, 0 },
+  ['q'] = { KEY_Q, 0 },
+  ['r'] = { KEY_R, 0 },
+  ['s'] = { KEY_S, 0 },
+  ['t'] = { KEY_T, 0 },
+  ['u'] = { KEY_U, 0 },
+  ['v'] = { KEY_V, 0 },
+  ['w'] = { KEY_W, 0 },
+  ['x'] = { KEY_X, 0 },
+  ['y'] = { KEY_Y, 0 },
+  ['z'] = { KEY_Z, 0 },
+  ['A'] = { KEY_A, RM_MOD_SHIFT },
+  ['B'] = { KEY_B, RM_MOD_SHIFT },
+  ['C'] = { KEY_C, RM_MOD_SHIFT },
+  ['D'] = { KEY_D, RM_MOD_SHIFT },
+  ['E'] = { KEY_E, RM_MOD_SHIFT },
+  ['F'] = { KEY_F, RM_MOD_SHIFT },
+  ['G'] = { KEY_G, RM_MOD_SHIFT },
+  ['H'] = { KEY_H, RM_MOD_SHIFT },
+  ['I'] = { KEY_I, RM_MOD_SHIFT },
+  ['J'] = { KEY_J, RM_MOD_SHIFT },
+  ['K'] = { KEY_K, RM_MOD_SHIFT },
+  ['L'] = { KEY_L, RM_MOD_SHIFT },
+  ['M'] = { KEY_M, RM_MOD_SHIFT },
+  ['N'] = { KEY_N, RM_MOD_SHIFT },
+  ['O'] = { KEY_O, RM_MOD_SHIFT },
+  ['P'] = { KEY_P, RM_MOD_SHIFT },
+  ['Q'] = { KEY_Q, RM_MOD_SHIFT },
+  ['R'] = { KEY_R, RM_MOD_SHIFT },
+  ['S'] = { KEY_S, RM_MOD_SHIFT },
+  ['T'] = { KEY_T, RM_MOD_SHIFT },
+  ['U'] = { KEY_U, RM_MOD_SHIFT },
+  ['V'] = { KEY_V, RM_MOD_SHIFT },
+  ['W'] = { KEY_W, RM_MOD_SHIFT },
+  ['X'] = { KEY_X, RM_MOD_SHIFT },
+  ['Y'] = { KEY_Y, RM_MOD_SHIFT },
+  ['Z'] = { KEY_Z, RM_MOD_SHIFT },
+  ['!'] = { KEY_1, RM_MOD_SHIFT },
+  ['@'] = { KEY_2, RM_MOD_SHIFT },
+  ['#'] = { KEY_3, RM_MOD_SHIFT },
+  ['$'] = { KEY_4, RM_MOD_SHIFT },
+  ['%'] = { KEY_5, RM_MOD_SHIFT },
+  ['^'] = { KEY_6, RM_MOD_SHIFT },
+  ['&'] = { KEY_7, RM_MOD_SHIFT },
+  ['*'] = { KEY_8, RM_MOD_SHIFT },
+  ['('] = { KEY_9, RM_MOD_SHIFT },
+  [')'] = { KEY_0, RM_MOD_SHIFT },
+  ['_'] = { KEY_MINUS, RM_MOD_SHIFT },
+  ['+'] = { KEY_EQUAL, RM_MOD_SHIFT },
+  ['{'] = { KEY_LEFTBRACE, RM_MOD_SHIFT },
+  ['}'] = { KEY_RIGHTBRACE, RM_MOD_SHIFT },
+  ['|'] = { KEY_BACKSLASH, RM_MOD_SHIFT },
+  [':'] = { KEY_SEMICOLON, RM_MOD_SHIFT },
+  ['"'] = { KEY_APOSTROPHE, RM_MOD_SHIFT },
+  ['~'] = { KEY_GRAVE, RM_MOD_SHIFT },
+  ['<'] = { KEY_COMMA, RM_MOD_SHIFT },
+  ['>'] = { KEY_DOT, RM_MOD_SHIFT },
+  ['?'] = { KEY_SLASH, RM_MOD_SHIFT },
+};
+/* X keysyms 0xff00-0xffff */
+static const unsigned char ff_keysym_keys[256] = {
+  [0x08] = KEY_BACKSPACE, [0x09] = KEY_TAB, [0x0d] = KEY_ENTER,
+  [0x13] = KEY_PAUSE, [0x14] = KEY_SCROLLLOCK, [0x1b] = KEY_ESC,
+  [0x50] = KEY_HOME, [0x51] = KEY_LEFT, [0x52] = KEY_UP,
+  [0x53] = KEY_RIGHT, [0x54] = KEY_DOWN, [0x55] = KEY_PAGEUP,
+  [0x56] = KEY_PAGEDOWN, [0x57] = KEY_END, [0x61] = KEY_PRINT,
+  [0x63] = KEY_INSERT, [0x67] = KEY_MENU, [0x7f] = KEY_NUMLOCK,
+  [0x8d] = KEY_KPENTER,
+  [0xbe] = KEY_F1, [0xbf] = KEY_F2, [0xc0] = KEY_F3, [0xc1] = KEY_F4,
+  [0xc2] = KEY_F5, [0xc3] = KEY_F6, [0xc4] = KEY_F7, [0xc5] = KEY_F8,
+  [0xc6] = KEY_F9, [0xc7] = KEY_F10, [0xc8] = KEY_F11, [0xc9] = KEY_F12,
+  [0xe1] = KEY_LEFTSHIFT, [0xe2] = KEY_RIGHTSHIFT, [0xe3] = KEY_LEFTCTRL,
+  [0xe4] = KEY_RIGHTCTRL, [0xe5] = KEY_CAPSLOCK, [0xe7] = KEY_LEFTMETA,
+  [0xe8] = KEY_RIGHTMETA, [0xe9] = KEY_LEFTALT, [0xea] = KEY_RIGHTALT,
+  [0xeb] = KEY_LEFTMETA, [0xec] = KEY_RIGHTMETA, [0xff] = KEY_DELETE,
+};
+static const int mod_keys[] = {
+  KEY_LEFTSHIFT, KEY_LEFTCTRL, KEY_LEFTALT, KEY_LEFTMETA,
+};
+#define N_MODS (sizeof(mod_keys)/sizeof(mod_keys[0]))
+
+struct key_emitter {
+  struct frame_batch b;
+  struct pacer pace;
+  uint64_t frame;
+  uint mods; /* currently held */
+};
+/* gpio-keys would silently drop all but its five keys, so this needs
+ * the full keyboard */
+static int key_emitter_init(struct key_emitter *e, struct rM_input_devices *ds,
+                            uint frame_interval_us) {
+  if (ds->priv->full_kbd_fd < 0) { return -1; }
+  e->b.fd = ds->priv->full_kbd_fd;
+  e->b.n = 0; e->b.err = 0;
+  e->frame = 0;
+  e->mods = 0;
+  pacer_init(&e->pace, (uint64_t)frame_interval_us*1000);
+  return 0;
+}
+static void emit_mods(struct key_emitter *e, uint mods) {
+  for (uint m = 0; m < N_MODS; ++m) {
+    if ((mods ^ e->mods) & (1 << m)) {
+      batch_ev(&e->b, EV_KEY, mod_keys[m], !!(mods & (1 << m)));
+    }
+  }
+  e->mods = mods;
+}
+static void emit_chord(struct key_emitter *e, int key, uint mods) {
+  pacer_wait(&e->pace, &e->b, e->frame++);
+  batch_reserve(&e->b, N_MODS+2);
+  emit_mods(e, mods);
+  batch_ev(&e->b, EV_KEY, key, 1);
+  batch_ev(&e->b, EV_SYN, SYN_REPORT, 0);
+  pacer_wait(&e->pace, &e->b, e->frame++);
+  batch_reserve(&e->b, 2);
+  batch_ev(&e->b, EV_KEY, key, 0);
+  batch_ev(&e->b, EV_SYN, SYN_REPORT, 0);
+  /* unpaced, a whole batch would land in each reader's evdev buffer
+   * (as small as 64 events) at once, and overflow it */
+  if (!e->pace.period_ns) { batch_flush(&e->b); }
+}
+static int emit_finish(struct key_emitter *e) {
+  if (e->mods) {
+    pacer_wait(&e->pace, &e->b, e->frame++);
+    batch_reserve(&e->b, N_MODS+1);
+    emit_mods(e, 0);
+    batch_ev(&e->b, EV_SYN, SYN_REPORT, 0);
+  }
+  batch_flush(&e->b);
+  return e->b.err ? -1 : 0;
+}
+
+int submit_key_sequence(struct rM_input_devices *ds,
+                        const struct rM_key_chord *keys, size_t n,
+                        uint frame_interval_us) {
+  struct key_emitter e;
+  if (key_emitter_init(&e, ds, frame_interval_us) < 0) { return -1; }
+  for (size_t i = 0; i < n; ++i) { emit_chord(&e, keys[i].key, keys[i].mods); }
+  return emit_finish(&e);
+}
+static int keysym_chord(uint keysym, int *key, uint *mods) {
+  if (keysym < 0x80 && ascii_keys[keysym].key) {
+    *key = ascii_keys[keysym].key; *mods = ascii_keys[keysym].mods;
+    return 1;
+  }
+  if ((keysym & ~0xff) == 0xff00 && ff_keysym_keys[keysym & 0xff]) {
+    *key = ff_keysym_keys[keysym & 0xff]; *mods = 0;
+    return 1;
+  }
+  return 0;
+}
+int submit_keysyms(struct rM_input_devices *ds, const uint *keysyms, size_t n,
+                   uint frame_interval_us) {
+  struct key_emitter e;
+  if (key_emitter_init(&e, ds, frame_interval_us) < 0) { return -1; }
+  int missing = 0;
+  for (size_t i = 0; i < n; ++i) {
+    int key; uint mods;
+    if (keysym_chord(keysyms[i], &key, &mods)) { emit_chord(&e, key, mods); }
+    else { missing++; }
+  }
+  return emit_finish(&e) < 0 ? -1 : missing;
+}
+int submit_text(struct rM_input_devices *ds, const char *utf8,
+                uint frame_interval_us) {
+  struct key_emitter e;
+  if (key_emitter_init(&e, ds, frame_interval_us) < 0) { return -1; }
+  int missing = 0;
+  for (const unsigned char *c = (const unsigned char *)utf8; *c; ) {
+    int key; uint mods;
+    if (*c < 0x80) {
+      if (keysym_chord(*c, &key, &mods)) { emit_chord(&e, key, mods); }
+      else { missing++; }
+      c++;
+      continue;
+    }
+    /* anything else can't be typed on a US layout: skip the sequence */
+    missing++;
+    c++;
+    while ((*c & 0xc0) == 0x80) { c++; }
+  }
+  return emit_finish(&e) < 0 ? -1 : missing;
+}
+
+int rm_input_trace_enable(struct rM_input_devices *ds, uint capacity) {
+  struct trace_data *tr = &ds->priv->trace;
+  uint cap = 1;
+  while (cap < (capacity ? capacity : TRACE_DEFAULT_FRAMES)) { cap <<= 1; }
+  pthread_mutex_lock(&ds->priv->input_thread_mutex);
+  /* the input thread may still be writing to the buffer, even if
+   * tracing has just been disabled, so it can't be swapped out */
+  if (tr->buf && capacity && cap != tr->capacity) {
+    pthread_mutex_unlock(&ds->priv->input_thread_mutex);
+    return -1;
+  }
+  if (!tr->buf) {
+    tr->buf = calloc(cap, sizeof(struct rM_trace_frame));
+    if (!tr->buf) { pthread_mutex_unlock(&ds->priv->input_thread_mutex); return -1; }
+    tr->capacity = cap;
+  }
+  /* so that t_kernel is on the same clock as everything else */
+  int clk = CLOCK_MONOTONIC;
+  struct fd_list *lists[] = {
+    ds->priv->extra_wacom_fds,
+    ds->priv->extra_touch_fds,
+    ds->priv->extra_key_fds,
+  };
+  int primaries[] = { ds->digitizer, ds->touch, ds->kbd };
+  for (int t = 0; t < 3; ++t) {
+    ioctl(primaries[t], EVIOCSCLOCKID, &clk);
+    for (struct fd_list *f = lists[t]; f; f = f->next) {
+      ioctl(f->fd, EVIOCSCLOCKID, &clk);
+    }
+  }
+  __atomic_store_n(&tr->enabled, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&ds->priv->input_thread_mutex);
+  return 0;
+}
+int rm_input_trace_disable(struct rM_input_devices *ds) {
+  __atomic_store_n(&ds->priv->trace.enabled, 0, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static const char *trace_dev_names[] = {
+  [RM_TRACE_PEN] = "pen", [RM_TRACE_TOUCH] = "touch", [RM_TRACE_KEY] = "key",
+};
+static void trace_json_span(FILE *f, int *first, const struct rM_trace_frame *fr,
+                            const char *name, int64_t from, int64_t to) {
+  if (!from || !to || to < from) { return; }
+  fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+          "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+          "\"args\":{\"frame\":%llu,\"source\":%u}}",
+          *first ? "" : ",", name, trace_dev_names[fr->dev], fr->dev,
+          from/1000.0, (to-from)/1000.0, (unsigned long long)fr->seq,
+          fr->source);
+  *first = 0;
+}
+int rm_input_trace_export(struct rM_input_devices *ds, int fd, uint format) {
+  struct trace_data *tr = &ds->priv->trace;
+  if (!tr->buf) { return -1; }
+  uint64_t cap = tr->capacity;
+  uint64_t head = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE);
+  uint64_t start = head > cap ? head - cap : 0;
+  struct rM_trace_frame *frames = malloc((head-start)*sizeof(struct rM_trace_frame) + 1);
+  if (!frames) { return -1; }
+  for (uint64_t i = start; i < head; ++i) {
+    frames[i-start] = tr->buf[i & (cap-1)];
+  }
+  /* the writer may since have overwritten (or be writing) the oldest */
+  uint64_t head2 = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE);
+  uint64_t first = head2 + 1 > cap ? head2 + 1 - cap : 0;
+  if (first < start) { first = start; }
+  if (first > head) { first = head; }
+  struct rM_trace_frame *fs = frames + (first - start);
+  uint32_t n = head - first;
+
+  int ret = 0;
+  if (format == RM_TRACE_BINARY) {
+    struct rM_trace_header h = {
+      .magic = RM_TRACE_MAGIC,
+      .frame_size = sizeof(struct rM_trace_frame),
+      .n_frames = n,
+    };
+    if (write(fd, &h, sizeof(h)) != sizeof(h) ||
+        write(fd, fs, n*sizeof(struct rM_trace_frame)) !=
+        (ssize_t)(n*sizeof(struct rM_trace_frame))) { ret = -1; }
+  } else {
+    FILE *f = fdopen(dup(fd), "w");
+    if (!f) { free(frames); return -1; }
+    int first = 1;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (uint32_t i = 0; i < n; ++i) {
+      const struct rM_trace_frame *fr = &fs[i];
+      trace_json_span(f, &first, fr, "kernel", fr->t_kernel, fr->t_wake);
+      trace_json_span(f, &first, fr, "read", fr->t_wake, fr->t_read);
+      trace_json_span(f, &first, fr, "decode", fr->t_read, fr->t_decode);
+      trace_json_span(f, &first, fr, "convert", fr->t_decode, fr->t_convert);
+      trace_json_span(f, &first, fr, "deliver", fr->t_convert, fr->t_deliver);
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f)) { ret = -1; }
+  }
+  free(frames);
+  return ret < 0 ? -1 : (int)n;
+}
+
+int rm_input_ink_enable(struct rM_input_devices *ds, uint coord_kind,
+                        uint n_points, handle_ink_event_t handle, void *data) {
+  struct ink_data *ink = &ds->priv->ink;
+  struct wacom_data *wd = &ds->priv->wd;
+  pthread_mutex_lock(&wd->mutex);
+  if (ink->cur) {
+    /* never handed out, so nobody else will release it */
+    ink_release(ink, ink->cur);
+    ink->cur = NULL;
+  }
+  ink->handle = handle;
+  ink->userdata = data;
+  ink->coord_kind = coord_kind;
+  int ret = 0;
+  if (handle) {
+    pthread_mutex_lock(&ink->mutex);
+    if (!ink->grow_chunks) {
+      if (!n_points) { n_points = INK_DEFAULT_POINTS; }
+      ink->grow_chunks = (n_points + RM_INK_CHUNK_POINTS-1)/RM_INK_CHUNK_POINTS;
+      ink->grow_strokes = INK_DEFAULT_STROKES;
+      ret = ink_grow_chunks(ink) < 0 || ink_grow_strokes(ink) < 0 ? -1 : 0;
+    }
+    pthread_mutex_unlock(&ink->mutex);
+  }
+  pthread_mutex_unlock(&wd->mutex);
+  return ret;
+}
+void rm_ink_stroke_release(struct rM_input_devices *ds,
+                           const struct rM_ink_stroke *stroke) {
+  ink_release(&ds->priv->ink, (struct rM_ink_stroke *)stroke);
 }
@@ -2,6 +2,9 @@
 #define RM_INPUT_DEVICES_H_
 
 #include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/input.h>
 
 /* file descriptors */
 struct rM_input_devices {
@@ -28,6 +31,39 @@ struct rM_coord {
 /* needed for an on_*_event, and for submit_touch_* */
 int enable_input_event_listening(struct rM_input_devices *ds);
 
+/* How the input thread waits for events; must be chosen before
+ * enable_input_event_listening. epoll is the default. io_uring is only
+ * available when built with IO_URING=1, and is then chosen here or by
+ * setting RM_INPUT_DEVICES_IO_ENGINE=io_uring (rM-input-bench compares
+ * the two); if the running kernel lacks io_uring, the input thread
+ * falls back to epoll. Returns the engine that will be tried. */
+#define RM_IO_ENGINE_EPOLL 0x1
+#define RM_IO_ENGINE_IO_URING 0x2
+int set_input_io_engine(struct rM_input_devices *ds, uint engine);
+
+/* Every device of a type (the digitizer, say, and a uinput clone of
+ * it) is decoded on its own, as a source: 0 for the primary
+ * (ds->digitizer, ds->touch, ds->kbd), and 1, 2, ... for the others,
+ * in the order they were found. The merge policy decides which
+ * sources' frames are delivered (and published as snapshots):
+ * - RM_MERGE_ALL_SOURCES (the default): all of them, as they come;
+ * - RM_MERGE_LATEST_WINS: one source at a time. The pen stays with
+ *   its source until it leaves proximity, and touch goes to the source
+ *   that last started touching; the others' pen and touch frames are
+ *   dropped meanwhile (until they lift and touch again, for touch).
+ *   Keys go to whichever source sent the latest frame: the keys the
+ *   last one holds are first released (in a frame of their own), and
+ *   pressed again if it comes back while still holding them;
+ * - RM_MERGE_PRIMARY_ONLY: only those from source 0.
+ * Returns the policy in effect. */
+#define RM_MERGE_ALL_SOURCES 0x1
+#define RM_MERGE_LATEST_WINS 0x2
+#define RM_MERGE_PRIMARY_ONLY 0x3
+int set_input_merge_policy(struct rM_input_devices *ds, uint policy);
+/* The source of the frame being delivered; only meaningful inside a
+ * handler. */
+int rm_input_frame_source(struct rM_input_devices *ds);
+
 /* the various handle_* fns should be idempotent */
 
 #define WHICH_WACOM_PEN 0x1
@@ -44,6 +80,46 @@ typedef void (*handle_wacom_event_t)(void *, int pen_down, int touch_down,
 int on_wacom_event(struct rM_input_devices *ds, uint coord_kind,
                    handle_wacom_event_t handle, void *);
 
+/* Filters applied by the input thread to each pen frame before it is
+ * handed to the handler, in this order: deadband, One Euro, pressure
+ * curve. Positions are filtered in evdev units, before any conversion
+ * to display coordinates. All state is reset when the pen leaves
+ * proximity, and when the subscription is replaced.
+ *
+ * deadband: while the pen touches the surface, a move of at most
+ *   `deadband` units on both axes from the last reported position is
+ *   reported as that position. No added delay at rest, but the start
+ *   of a stroke is held until it leaves the deadband.
+ * One Euro (Casiez et al., CHI 2012): an adaptive low-pass whose
+ *   cutoff is min_cutoff + beta*|speed|. Cutoffs are in Hz and beta
+ *   in Hz per (unit/s), all Q16.16; speed is in evdev units/s. The
+ *   lag is about 1/(2*pi*cutoff) seconds: ~160ms at a 1Hz cutoff when
+ *   resting, shrinking as the pen speeds up. dcutoff (usually 1Hz)
+ *   smooths the speed estimate.
+ * pressure curve: pressure_curve[i] is the output for an input
+ *   pressure of i*RM_PRESSURE_MAX/RM_PRESSURE_CURVE_SEGS (so the last
+ *   point is at RM_PRESSURE_MAX), interpolated linearly in between.
+ *   No added delay. */
+#define RM_FILTER_DEADBAND 0x1
+#define RM_FILTER_ONE_EURO 0x2
+#define RM_FILTER_PRESSURE_CURVE 0x4
+#define RM_PRESSURE_MAX 4095
+#define RM_PRESSURE_CURVE_SEGS 16
+#define RM_PRESSURE_CURVE_POINTS (RM_PRESSURE_CURVE_SEGS+1)
+#define RM_Q16(x) ((uint)((x)*65536.0))
+struct rM_pen_filter {
+  uint filters;
+  uint deadband;
+  uint one_euro_min_cutoff;
+  uint one_euro_beta;
+  uint one_euro_dcutoff;
+  int pressure_curve[RM_PRESSURE_CURVE_POINTS];
+};
+/* like on_wacom_event; filter may be NULL */
+int on_filtered_wacom_event(struct rM_input_devices *ds, uint coord_kind,
+                            const struct rM_pen_filter *filter,
+                            handle_wacom_event_t handle, void *);
+
 #define WHICH_TOUCH_X 1
 #define WHICH_TOUCH_Y 2
 int touch_begin_contact(struct rM_input_devices *ds);
@@ -54,8 +130,275 @@ typedef void (*handle_touch_event_t)(void *, int c, int abs_x, int abs_y);
 int on_touch_event(struct rM_input_devices *ds, uint coord_kind,
                    handle_touch_event_t handle, void *);
 
+/* Stroke synthesis. A path is either a polyline through n_points
+ * points, or a chain of cubic Beziers sharing end points (3k+1
+ * control points, k >= 1; other counts fail with -1). The library
+ * spreads duration_ms*rate_hz samples along the path by (estimated)
+ * arc length and writes them one frame each 1/rate_hz seconds (a
+ * sender that falls behind catches up in writes of at most 64
+ * events), or, if unpaced is set, as fast as possible, a frame per
+ * write(); a reader that can't keep up with that still sees a
+ * SYN_DROPPED. These calls block until the whole stroke has been
+ * written. */
+struct rM_point {
+  int x;
+  int y;
+};
+#define RM_PATH_POLYLINE 0x0
+#define RM_PATH_CUBIC 0x1
+struct rM_path {
+  uint coord_kind;
+  uint kind;
+  const struct rM_point *points;
+  uint n_points;
+};
+struct rM_stroke_timing {
+  uint rate_hz;
+  uint duration_ms;
+  int unpaced;
+};
+/* Pen down along path and up at its end; the pressure profile is
+ * spread evenly over the samples (NULL means a constant mid-range
+ * pressure). */
+int submit_wacom_stroke(struct rM_input_devices *ds, const struct rM_path *path,
+                        const int *pressure, uint n_pressure,
+                        const struct rM_stroke_timing *timing);
+/* One contact per path (at most 32), all moving in the same frames */
+int submit_touch_strokes(struct rM_input_devices *ds,
+                         const struct rM_path *paths, uint n_paths,
+                         const struct rM_stroke_timing *timing);
+
+/* Decoders. These assemble the input_events of a digitizer or a
+ * touchscreen into frames without doing any I/O or locking, so they
+ * also work over recorded traces or any other buffer. Each call
+ * decodes as much of evs as it can and returns the number of events
+ * it consumed. The handler gets the decoder's own state (don't keep
+ * the pointer) and the SYN_REPORT that ended the frame. A SYN_DROPPED
+ * stops decoding with resync_needed set, so that a caller with the
+ * device at hand can reload the state (EVIOCGKEY, EVIOCGABS,
+ * EVIOCGMTSLOTS) before going on; the events up to the next
+ * SYN_REPORT are discarded either way. The source field of a state
+ * is the caller's: init zeroes it, and decoding leaves it alone. */
+struct rM_pen_state {
+  int source;
+  int pen_down;
+  int touch_down;
+  int abs_x;
+  int abs_y;
+  int abs_pressure;
+};
+struct rM_pen_decoder {
+  struct rM_pen_state state;
+  int drop_until_syn;
+  int resync_needed;
+};
+typedef void (*handle_pen_frame_t)(void *, const struct rM_pen_state *,
+                                   const struct input_event *syn);
+void rm_pen_decoder_init(struct rM_pen_decoder *d);
+size_t rm_decode_pen_events(struct rM_pen_decoder *d,
+                            const struct input_event *evs, size_t n,
+                            handle_pen_frame_t handle, void *);
+
+#define RM_N_SLOTS 32
+struct rM_touch_state {
+  int source;
+  int current_slot; /* -1 if the device selected a slot we don't track */
+  int slots[RM_N_SLOTS]; /* tracking id, or -1 if the slot is unused */
+  int abs_x[RM_N_SLOTS];
+  int abs_y[RM_N_SLOTS];
+};
+struct rM_touch_decoder {
+  struct rM_touch_state state;
+  int drop_until_syn;
+  int resync_needed;
+};
+typedef void (*handle_touch_frame_t)(void *, const struct rM_touch_state *,
+                                     const struct input_event *syn);
+void rm_touch_decoder_init(struct rM_touch_decoder *d);
+size_t rm_decode_touch_events(struct rM_touch_decoder *d,
+                              const struct input_event *evs, size_t n,
+                              handle_touch_frame_t handle, void *);
+
+/* The device state as of the most recent frame delivered (so, of the
+ * source that sent it; see the merge policy), in evdev coordinates,
+ * without taking any locks (so it is safe from any thread, including
+ * inside a handler). Returns a counter that is bumped each time the
+ * state is published, so that a poller can tell whether anything has
+ * changed. */
+int rm_input_get_pen_state(struct rM_input_devices *ds,
+                           struct rM_pen_state *state);
+int rm_input_get_touch_state(struct rM_input_devices *ds,
+                             struct rM_touch_state *state);
+
+/* Keys are kept as bitmaps indexed by key code. A key frame carries
+ * the keys that are down at its end, and those that went down, came
+ * up, or repeated during it. */
+#define RM_KEY_BYTES ((KEY_MAX+8)/8)
+#define RM_KEY_IS_SET(bits, key) ((bits)[(key)/8] & (1 << ((key)%8)))
+struct rM_key_state {
+  int source;
+  unsigned char down[RM_KEY_BYTES];
+  unsigned char pressed[RM_KEY_BYTES];
+  unsigned char released[RM_KEY_BYTES];
+  unsigned char repeated[RM_KEY_BYTES];
+};
+struct rM_key_decoder {
+  struct rM_key_state state;
+  unsigned char reported[RM_KEY_BYTES]; /* down, as of the last frame */
+  int changed;
+  int drop_until_syn;
+  int resync_needed;
+};
+/* Frames that change nothing are not reported */
+typedef void (*handle_key_frame_t)(void *, const struct rM_key_state *,
+                                   const struct input_event *syn);
+void rm_key_decoder_init(struct rM_key_decoder *d);
+size_t rm_decode_key_events(struct rM_key_decoder *d,
+                            const struct input_event *evs, size_t n,
+                            handle_key_frame_t handle, void *);
+
 int submit_key_event(struct rM_input_devices *ds, int key, int down);
+/* Called for each key in each frame: releases, then presses, then
+ * repeats (down == 2). A key that went both down and up within the
+ * frame is reported in the order that leaves it as it ended: released
+ * then pressed if it is down at the end of the frame, pressed then
+ * released if not. */
 typedef void (*handle_key_event_t)(void *, int key, int down);
 int on_key_event(struct rM_input_devices *ds, handle_key_event_t handle, void *);
+/* Called once per key frame. A key may be in both pressed and
+ * released, if it went both ways within the frame; down says which
+ * way it ended. After a SYN_DROPPED, the key state is
+ * reloaded from the kernel, and the keys that changed meanwhile are
+ * reported in a frame whose syn is the SYN_DROPPED; autorepeat frames
+ * have a NULL syn, the keys down as of the last frame, and only the
+ * repeating key in repeated. */
+int on_key_frame(struct rM_input_devices *ds, handle_key_frame_t handle, void *);
+/* Text injection. The gpio-keys device only has the five buttons, so
+ * this creates (via uinput) a keyboard device with every key, which
+ * submit_key_sequence/submit_keysyms/submit_text then use; until it
+ * has been called, they fail with -1. */
+int enable_full_keyboard(struct rM_input_devices *ds);
+#define RM_MOD_SHIFT 0x1
+#define RM_MOD_CTRL 0x2
+#define RM_MOD_ALT 0x4
+#define RM_MOD_META 0x8
+struct rM_key_chord {
+  unsigned short key;
+  unsigned short mods;
+};
+/* Each chord is a press and a release of key, with mods held; frames
+ * are frame_interval_us apart, or, if that is 0, written as fast as
+ * possible, a chord per write(). Each reader of the device has an
+ * evdev buffer of as few as 64 events, and sees a SYN_DROPPED if it
+ * falls further behind than that, which unpaced typing of long text
+ * can cause; an interval of 1000us (at most 6 events per frame) gives
+ * readers ~10ms to keep up. These block until everything has been
+ * written. */
+int submit_key_sequence(struct rM_input_devices *ds,
+                        const struct rM_key_chord *keys, size_t n,
+                        uint frame_interval_us);
+/* X keysyms and UTF-8, on a US layout: printable ASCII, and the 0xffxx
+ * function keys (keysyms only). Anything else, including the rest of
+ * Latin-1, has no key on that layout and is skipped; returns how many
+ * characters were, or -1 if a write failed. */
+int submit_keysyms(struct rM_input_devices *ds, const uint *keysyms, size_t n,
+                   uint frame_interval_us);
+int submit_text(struct rM_input_devices *ds, const char *utf8,
+                uint frame_interval_us);
+
+/* Repeat the most recently pressed key after delay_ms (or, if that is
+ * 0, after one period), then every period_ms, on the input thread; a
+ * period of 0 disables this. Most keyboards autorepeat by themselves,
+ * which is reported the same way. */
+int set_key_repeat(struct rM_input_devices *ds, uint delay_ms, uint period_ms);
+
+/* Ink capture: the library assembles pen-down to pen-up strokes
+ * itself, out of a pool of fixed-size chunks of points. The handler
+ * sees RM_INK_BEGIN with the first point of a stroke, RM_INK_UPDATE
+ * with each later one and RM_INK_END once the pen lifts; latest is the
+ * point just added (the last point, for RM_INK_END). Until
+ * RM_INK_END, a stroke is the library's and must only be read; after
+ * it, it is the handler's, and must be given back with
+ * rm_ink_stroke_release (from any thread) once done with. Points are
+ * filtered like on_filtered_wacom_event's, if a filter is set there.
+ * n_points sizes the pool (0 for a default); it only grows if
+ * unreleased strokes use it all up. */
+#define RM_INK_CHUNK_POINTS 64
+struct rM_ink_point {
+  int32_t x;
+  int32_t y;
+  int32_t pressure;
+  uint32_t t_us; /* since the stroke began */
+};
+struct rM_ink_chunk {
+  struct rM_ink_chunk *next;
+  uint n;
+  struct rM_ink_point points[RM_INK_CHUNK_POINTS];
+};
+/* the points are first->points[0..n), first->next->points[..], ... */
+struct rM_ink_stroke {
+  uint id;
+  int source; /* a stroke follows the one source that began it */
+  uint n_points;
+  int64_t t_start_us; /* the SYN_REPORT time of the first point */
+  struct rM_ink_chunk *first;
+  struct rM_ink_chunk *last;
+  struct rM_ink_stroke *next_free; /* the library's */
+};
+#define RM_INK_BEGIN 1
+#define RM_INK_UPDATE 2
+#define RM_INK_END 3
+typedef void (*handle_ink_event_t)(void *, int what,
+                                   const struct rM_ink_stroke *stroke,
+                                   const struct rM_ink_point *latest);
+/* a NULL handle turns ink capture off */
+int rm_input_ink_enable(struct rM_input_devices *ds, uint coord_kind,
+                        uint n_points, handle_ink_event_t handle, void *);
+void rm_ink_stroke_release(struct rM_input_devices *ds,
+                           const struct rM_ink_stroke *stroke);
+
+/* Per-frame tracing. While enabled, the input thread records, for each
+ * frame it delivers, when (on CLOCK_MONOTONIC, in ns) the kernel
+ * stamped its SYN_REPORT, the input thread woke up, the events were
+ * read, the frame was decoded, converted (pen only: the filters and
+ * display coordinates; touch and key handlers convert as they go) and
+ * handed to its handler. The last `capacity` frames (rounded up to a
+ * power of two) are kept, in a buffer allocated on first use and kept
+ * for good: enabling again with another capacity fails. A capacity of
+ * 0 keeps the buffer there is, or allocates 4096 frames. Enabling
+ * switches the device fds to CLOCK_MONOTONIC timestamps
+ * (EVIOCSCLOCKID). Disabled tracing costs a plain load and a
+ * predictable branch at a few points per frame (waking, reading,
+ * delivering). */
+#define RM_TRACE_PEN 0
+#define RM_TRACE_TOUCH 1
+#define RM_TRACE_KEY 2
+struct rM_trace_frame {
+  uint32_t dev;
+  uint32_t source;
+  uint64_t seq;
+  int64_t t_kernel;
+  int64_t t_wake;
+  int64_t t_read;
+  int64_t t_decode;
+  int64_t t_convert;
+  int64_t t_deliver;
+};
+int rm_input_trace_enable(struct rM_input_devices *ds, uint capacity);
+int rm_input_trace_disable(struct rM_input_devices *ds);
+/* Writes the recorded frames to fd, either as Chrome/Perfetto trace
+ * JSON (one span per stage per frame), or as an rM_trace_header
+ * followed by n_frames struct rM_trace_frames, in host byte order.
+ * Returns the number of frames written, or -1. */
+#define RM_TRACE_JSON 0x1
+#define RM_TRACE_BINARY 0x2
+#define RM_TRACE_MAGIC 0x31545272 /* "rRT1" */
+struct rM_trace_header {
+  uint32_t magic;
+  uint32_t frame_size;
+  uint32_t n_frames;
+  uint32_t reserved;
+};
+int rm_input_trace_export(struct rM_input_devices *ds, int fd, uint format);
 
 #endif /* RM_INPUT_DEVICES_H_ */